@@ -1,25 +1,43 @@
+// Needed for splice(), fallocate() & memmem()
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <asm-generic/errno-base.h>
 #include <bits/getopt_core.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <magic.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 // Need to compile with -lmagic flag to use magic.h for get_mime_type()
+// Need to compile with -lpthread flag for the process-shared cache lock
 
 // Dir to house the static files for the server
 // Can be passed by the user when compiling manually, without make
@@ -34,13 +52,85 @@
 #define READ_BUFFER_SIZE 4096
 #define METHOD_SIZE 10
 #define PATH_SIZE 4096
+#define QUERY_SIZE 1024
 // Response related
 #define STATUS_SIZE 32
+// Cache related
+// Every cached file takes one slot, with its path & whole response
+#define CACHE_SLOT_SIZE 65536
+#define CACHE_SKETCH_ROWS 4
+// Segments of the cache, see cache_init()
+#define CACHE_WINDOW 0
+#define CACHE_PROBATION 1
+#define CACHE_PROTECTED 2
+#define CACHE_SEGMENTS 3
+// Archive related
+#define ARCHIVE_BUFFER_SIZE 65536
+#define ARCHIVE_MAX_DEPTH 128 // Directories open at once while archiving
+// Index related
+#define INDEX_MAGIC "SRVCIDX1"
+#define INDEX_NONE UINT32_MAX
+#define INDEX_WRITE_INTERVAL 2 // Seconds between writes of a changing index
+#define INDEX_EVENT_BUFFER_SIZE 65536
+#define INDEX_WATCH_EVENTS                                                     \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR |          \
+   IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define INDEX_CHECKED_LEN 16 // Index files known to be valid, see index_view()
+#define SEARCH_PAGE_SIZE 50
+#define SEARCH_SCAN_MAX 100000 // Entries looked at for queries with no trigram
+
+#define WATCH_MAX_DIRS 256   // Directories followed by event streams at once
+#define WATCH_RING_SIZE 1024 // Events kept for streams that fall behind
+#define WATCH_MAX_STREAMS 1024 // Event streams open at once
+#define WATCH_ALL UINT32_MAX // Event meant for every directory
+#define WATCH_EVENTS                                                           \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |      \
+   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+// Types of watch events, named by WATCH_EVENT_NAMES
+#define WATCH_ADD 0
+#define WATCH_REMOVE 1
+#define WATCH_MODIFY 2
+#define WATCH_RESET 3
+#define EVENTS_KEEPALIVE 15 // Seconds between comments on an idle stream
+// Upload related
+#define UPLOAD_BUFFER_SIZE 65536
+#define UPLOAD_TEMP_NAME_SIZE 64
+#define TOKEN_SIZE 256
+// Config related
+#define MAX_LISTENERS 16
+#define HOST_SIZE 256
+#define CACHE_CONTROL_SIZE 128
+// Largest piece of a response written in one go, responses bigger than this
+// are sent chunk by chunk, so that they can be shaped by the rate limits
+#define SEND_CHUNK_SIZE 65536
 
 // Variable to determine running status of server
 // Used for shutting down server with SIGTERM/SIGINT
 volatile sig_atomic_t running = 1;
 
+// Set by SIGHUP to reload the configuration, and by SIGUSR2 to start a new
+// binary on the same listening socket. Both are handled in the accept loop
+volatile sig_atomic_t reload = 0;
+volatile sig_atomic_t upgrade = 0;
+// Shutdown, reload & upgrade signals, blocked in the accept loop outside of
+// its wait, so none of them is noticed late. Unblocked again in every process
+// the server forks
+sigset_t control_signals;
+
+// Connections still being served by children, waited on while shutting down
+volatile sig_atomic_t active_children = 0;
+// PIDs of those children, the first 'active_children' are in use. Only
+// changed with SIGCHLD blocked, or by its handler
+pid_t *connection_pids = NULL;
+int connection_pids_size = 0;
+// PID of the new binary started by SIGUSR2, it is not a connection
+volatile sig_atomic_t upgrade_pid = 0;
+// PID of the process keeping the search indexes up to date, not a connection
+// either, see start_indexer()
+volatile sig_atomic_t indexer_pid = 0;
+// PID of the process watching directories for event streams, see run_watcher()
+volatile sig_atomic_t watcher_pid = 0;
+
 // Client struct, store information on a client: file descriptor (returned by
 // accept function) ,client_address (filled by accept()) which can be parsed to
 // version 4 or 6 depending on usecase, address_len (also filled by accept()),
@@ -52,19 +142,200 @@ struct client_info {
   struct sockaddr_storage client_address;
   socklen_t address_len;
   char read_buffer[READ_BUFFER_SIZE];
+  unsigned int request_len; // Bytes read into read_buffer
   char request_method[METHOD_SIZE];
   char request_path[PATH_SIZE];
+  char request_query[QUERY_SIZE]; // Part of the path after '?', if any
   char *response;
   unsigned int response_len;
+  int body_fd;    // File sent after the response by send_file_body(), or -1
+  off_t body_len; // Bytes of 'body_fd' to send
   char response_status[STATUS_SIZE];
+  struct vhost *vhost; // Host the request is for, set by parse_request()
+  uint64_t next_send_ns; // Per-connection send clock, see wait_send_turn()
+};
+
+// Virtual host, picked for every request by its Host header
+// Every host serves its own root, with its own Cache-Control header & limits
+struct vhost {
+  char root[PATH_SIZE];
+  char cache_control[CACHE_CONTROL_SIZE]; // Not sent if empty
+  unsigned long rate_limit;               // Same as RATE_LIMIT, per host
+  char upload_token[TOKEN_SIZE];          // Uploads are refused if empty
+};
+
+// Slot of the host lookup table, one per host name
+// The table is built when the config is loaded, and probed linearly by hash,
+// so routing a request costs one hash of the Host header
+struct vhost_name {
+  uint32_t hash; // 0 marks an empty slot
+  char name[HOST_SIZE];
+  unsigned int vhost; // Index into 'vhosts'
+};
+
+// Cached response of a file, along with what the file looked like when it was
+// cached. Path & response are kept in the slot's part of the data area
+struct cache_entry {
+  uint64_t key;          // 0 marks a free slot
+  uint32_t path_len;     // With the null-terminator
+  uint32_t response_len; // Header & body
+  struct timespec mtime;
+  off_t size;
+  ino_t inode;
+  dev_t device;
+  int32_t prev, next; // Segment list, 'next' also links the free list
+  int32_t hash_next;  // Next slot in the same bucket
+  uint8_t segment;
+};
+
+// Doubly linked list of slots, most recently used at the head
+struct cache_list {
+  int32_t head, tail;
+  uint32_t len;
+};
+
+// Cache shared by all the processes, lives at the start of a shared mapping,
+// followed by the entries, buckets, sketch & data it points to
+// Mapped before forking, so the pointers are the same in every process
+struct cache {
+  pthread_mutex_t lock;
+  struct cache_entry *entries;
+  int32_t *buckets;
+  uint8_t *sketch; // Count-min sketch, 4 bit counters kept in bytes
+  char *data;      // CACHE_SLOT_SIZE bytes for every slot
+  uint32_t slots_len, buckets_len, sketch_width, sketch_additions;
+  uint32_t window_max, protected_max;
+  int32_t free_head;
+  struct cache_list segments[CACHE_SEGMENTS];
+};
+
+// Header of an index file, followed by the entries, trigrams, postings & names
+// it counts. Entries are in depth-first order, so everything under a
+// directory is the range of entries right after it
+struct index_header {
+  char magic[8];
+  char root[PATH_SIZE];
+  uint32_t entries_len, trigrams_len, postings_len, names_size;
+};
+
+// File or directory in an index file, entry 0 is the root itself
+struct index_entry {
+  uint32_t parent; // INDEX_NONE for the root
+  uint32_t end;    // One past the last entry under this one
+  uint32_t name;   // Offset into the names
+  uint32_t is_dir;
+  int64_t mtime_sec, mtime_nsec; // Directories only, as of their last listing
+};
+
+// Entries with a trigram in their lowercased name, 'len' entry ids in
+// ascending order from 'start' in the postings
+struct index_trigram {
+  uint32_t trigram;
+  uint32_t start, len;
+};
+
+// Parts of a mapped index file, set by index_view()
+struct index_view {
+  const struct index_header *header;
+  const struct index_entry *entries;
+  const struct index_trigram *trigrams;
+  const uint32_t *postings;
+  const char *names;
+};
+
+// File or directory in the indexer's copy of a root, see run_indexer()
+struct index_node {
+  char *name;
+  struct index_node *parent, *children;
+  struct index_node *prev, *next; // Siblings
+  struct index_node *hash_next;   // Next node in the same bucket
+  struct timespec mtime;          // Directories only, as of their last listing
+  uint32_t id;                    // Entry id while writing the index file
+  int wd;                         // inotify watch of a directory, or -1
+  uint16_t tree;
+  uint8_t is_dir;
+  uint8_t seen; // Used while listing the parent, see index_list()
+};
+
+// Root being indexed, every host root is indexed once, however many hosts
+// serve it. Every root has its own inotify instance, as roots can be nested
+struct index_tree {
+  char root[PATH_SIZE];
+  char file_path[PATH_SIZE];
+  struct index_node *top;
+  uint32_t nodes_len;
+  int dirty;            // Changed since the index file was written
+  uint64_t write_after; // Earliest time of the next write
+  int inotify_fd;
+  struct index_node **watches; // Directories by watch descriptor
+  int watches_len;
+};
+
+// Directory followed by event streams, see watch_subscribe()
+struct watch_dir {
+  char path[PATH_SIZE];
+  uint32_t subscribers;
+  uint32_t generation; // Bumped every time the slot goes to another directory
+  int wd;              // inotify watch, -1 if not added yet, -2 if it failed
+};
+
+// Event stream following a directory, owned by the connection process 'pid'
+// Marked 'dead' by the server when it reaps that process, the watcher then
+// drops the subscription, in case the stream could not do it itself
+struct watch_stream {
+  pid_t pid; // 0 for a free slot
+  int32_t dir;
+  uint32_t dead;
+};
+
+// Change to a followed directory, as published by the watcher
+struct watch_event {
+  uint64_t seq;        // Position in the ring, UINT64_MAX while being written
+  uint32_t dir;        // Slot of the directory, or WATCH_ALL
+  uint32_t generation; // Generation of the slot when the event happened
+  uint8_t type;
+  uint8_t is_dir;
+  char name[NAME_MAX + 1];
 };
 
-// Main server socket file descriptor
-int server_fd;
-struct sockaddr_in server_address;
+// Shared by the watcher and every event stream, mapped before forking
+// The watcher is the only writer of the ring, streams keep their own position
+// in it and start over with a reset if the watcher laps them
+struct watch_hub {
+  pthread_mutex_t lock; // Guards the directories
+  uint32_t wakeups;     // Futex, bumped whenever streams have something to do
+  uint32_t closing;     // Server is shutting down, streams have to end
+  uint64_t published;   // Events written to the ring so far
+  struct watch_dir dirs[WATCH_MAX_DIRS];
+  struct watch_stream streams[WATCH_MAX_STREAMS];
+  struct watch_event ring[WATCH_RING_SIZE];
+};
+
+// Body of an upload request, read with body_read() or body_to_file()
+struct request_body {
+  struct client_info *client;
+  const char *buffered; // Body bytes read along with the headers
+  size_t buffered_len;
+  int chunked;
+  uint64_t left; // Bytes left in the body, or in the current chunk
+  int started;   // A chunk was read, its CRLF comes before the next size
+  int done;
+  uint64_t deadline; // The whole body has to arrive before it
+};
+
+// Socket the server accepts connections on
+struct listener {
+  int fd;
+  struct sockaddr_storage address;
+  socklen_t address_len;
+};
+
+// Main server sockets, one for every 'listen' line in the config
+struct listener listeners[MAX_LISTENERS];
+unsigned int listeners_len = 0;
 
 // Supported methods for the server
-char *SUPPORTED_METHODS[] = {"GET"};
+char *SUPPORTED_METHODS[] = {"GET", "PUT", "POST"};
 
 // Root dir of server and port
 char root_dir[PATH_SIZE] = "\0";
@@ -75,8 +346,96 @@ int DEBUG = 0;
 
 // Pass -a to accept incoming connections from all IPs
 // By default, accepts request only from localhost
+// Only used if the config file has no 'listen' lines
 in_addr_t client_addr_t = INADDR_LOOPBACK;
 
+// Pass -m to change the size of the cache for small files, in MiB, 0 turns the
+// cache off
+unsigned long CACHE_SIZE = 16 * 1024 * 1024;
+struct cache *cache = NULL;
+// Cache hits are copied here, and sent from here
+char cache_hit_buffer[CACHE_SLOT_SIZE];
+
+// Pass -c to read listeners, settings & virtual hosts from a config file
+char *config_path = NULL;
+
+// Pass -u with a file holding a token to take uploads, PUT & POST requests
+// have to send it as 'Authorization: Bearer <token>'. Hosts in the config file
+// can set their own 'upload_token', uploads are off without a token
+char UPLOAD_TOKEN[TOKEN_SIZE] = "";
+
+// Pass -i to index the file names under every host root, searched with
+// '?search=' on any directory. Index files are kept in the given directory
+// and read back on startup, so a restart does not walk the roots again
+char *index_dir = NULL;
+
+// Index files every entry of which was checked already, by file identity,
+// shared by every process so each new index file is only checked once
+// Slot INDEX_CHECKED_LEN counts the files added, to replace the oldest one
+uint64_t *index_checked = NULL;
+// Set on reload, the new indexer starts once the old one has saved its indexes
+volatile sig_atomic_t indexer_restart = 0;
+
+// Indexer process state: roots being indexed, and their nodes hashed by
+// parent & name
+struct index_tree *index_trees = NULL;
+unsigned int index_trees_len = 0;
+struct index_node **index_buckets = NULL;
+uint32_t index_buckets_len = 0; // Always a power of 2
+uint32_t index_nodes_len = 0;
+
+// Live changes to directories, streamed with '?events' on any directory
+// A single watcher process follows every directory being streamed, and fans
+// its events out to all the streams, see run_watcher()
+struct watch_hub *watch_hub = NULL;
+int watch_notify_fd = -1; // eventfd, tells the watcher subscriptions changed
+char *WATCH_EVENT_NAMES[] = {"add", "remove", "modify", "reset"};
+
+// Virtual hosts and their lookup table, built by load_config()
+// Requests with an unknown or missing Host header go to 'default_vhost'
+struct vhost *vhosts = NULL;
+unsigned int vhosts_len = 0;
+struct vhost_name *vhost_names = NULL;
+unsigned int vhost_names_size = 0; // Always a power of 2
+struct vhost *default_vhost = NULL;
+
+// Pass -b to cap the bandwidth of every connection, and -B to cap the
+// bandwidth of all the connections combined, both in bytes per second
+// 0 means no limit, hosts in the config file can set their own 'rate'
+unsigned long RATE_LIMIT = 0;
+unsigned long GLOBAL_RATE_LIMIT = 0;
+
+// Pass -t to change how long a client gets to send the request headers, and
+// -w to change how long a client can go without accepting any response data,
+// both in seconds. Clients going past either are dropped
+unsigned int HEADER_TIMEOUT = 10;
+unsigned int SEND_TIMEOUT = 30;
+
+// Pass -T to change how long a client gets to send the whole body of an
+// upload, in seconds, however steadily it sends it. 0 turns the limit off
+unsigned int BODY_TIMEOUT = 3600;
+
+// Pass -g to change how long in-flight connections get to finish when
+// shutting down, in seconds. Connections still open after it are terminated
+unsigned int DRAIN_TIMEOUT = 30;
+
+// Settings above as the flags (or the defaults) set them, every load of the
+// config file starts over from these, so a directive taken out of the file
+// goes back to them on SIGHUP
+unsigned int header_timeout_flag, send_timeout_flag, body_timeout_flag,
+    drain_timeout_flag;
+unsigned long global_rate_limit_flag;
+
+// Path & arguments the server was started with, used to start the new binary
+// on SIGUSR2, and the '-r' argument, resolved again on SIGHUP
+char exe_path[PATH_SIZE] = "\0";
+char **saved_argv = NULL;
+char *root_arg = NULL;
+
+// Send clock shared by every child process, used for the global rate limit
+// Mapped in main() before forking, so every child sees the same clock
+uint64_t *global_send_ns = NULL;
+
 void err_n_die(const char *operation) {
   printf("%s failed!\n", operation);
   printf("Error Code: %d\n", errno);
@@ -92,6 +451,15 @@ void shutdown_handler(int s) {
   return;
 }
 
+// SIGHUP reloads the configuration, SIGUSR2 upgrades the binary
+// Only flags are set here, the work is done in the accept loop
+void reload_handler(int s) {
+  if (s == SIGHUP)
+    reload = 1;
+  else if (s == SIGUSR2)
+    upgrade = 1;
+}
+
 // Check if the method is supported, is present in SUPPORTED_METHODS
 // Returns 1 if the method is valid, 0 is not, and -1 in case of error
 int is_method_valid(const char *method) {
@@ -114,6 +482,22 @@ int is_method_valid(const char *method) {
   return 0;
 }
 
+// Marks the event stream of a reaped connection process as dead, if it had
+// one, and tells the watcher to drop it. Called from sigchild_handler(), so
+// only atomics & write() are used
+void watch_reaped(pid_t pid) {
+  if (!watch_hub)
+    return;
+  for (unsigned int i = 0; i < WATCH_MAX_STREAMS; ++i)
+    if (__atomic_load_n(&watch_hub->streams[i].pid, __ATOMIC_ACQUIRE) == pid) {
+      __atomic_store_n(&watch_hub->streams[i].dead, 1, __ATOMIC_RELEASE);
+      uint64_t one = 1;
+      ssize_t written = write(watch_notify_fd, &one, sizeof(one));
+      (void)written; // Fails only if the watcher has been told plenty already
+      return;
+    }
+}
+
 // Reaps all child processes and does not let them become zombie processes as
 // they occupy process table slots
 void sigchild_handler(int s) {
@@ -127,8 +511,23 @@ void sigchild_handler(int s) {
   // PID of child (-1 targets every child)
   // output param to set the exit status of the child to
   // WNOHANG means non-blocking
-  while (waitpid(-1, NULL, WNOHANG) > 0)
-    ;
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    if (pid == upgrade_pid) // New binary failed to start
+      upgrade_pid = 0;
+    else if (pid == indexer_pid)
+      indexer_pid = 0;
+    else if (pid == watcher_pid)
+      watcher_pid = 0;
+    else {
+      for (int i = 0; i < active_children; ++i)
+        if (connection_pids[i] == pid) {
+          connection_pids[i] = connection_pids[--active_children];
+          break;
+        }
+      watch_reaped(pid);
+    }
+  }
 
   errno = saved_errno;
 }
@@ -152,10 +551,27 @@ void parse_args(int argc, char *argv[]) {
           "Options:\n"
           "-a             Accept Incoming Connections from all IPs, defaults "
           "to Localhost only.\n"
+          "-b <KiB/s>     Bandwidth limit of every connection.\n"
+          "-B <KiB/s>     Bandwidth limit of all connections combined.\n"
+          "-c <file>      Config file with listeners & virtual hosts.\n"
           "-d             Debug Mode, prints every major function call.\n"
+          "-g <seconds>   Time in-flight connections get to finish on "
+          "shutdown, defaults to 30.\n"
           "-h             Print this help message.\n"
+          "-i <directory> Index file names under the served directories, "
+          "keeping the index files in <directory>.\n"
+          "-m <MiB>       Size of the cache for small files, defaults to 16, "
+          "0 to turn off.\n"
           "-p <port>      Port to listen on.\n"
-          "-r <directory> Directory to serve.\n",
+          "-r <directory> Directory to serve.\n"
+          "-t <seconds>   Time allowed to send the request headers, defaults "
+          "to 10.\n"
+          "-T <seconds>   Time allowed to send a whole upload body, defaults "
+          "to 3600, 0 to turn off.\n"
+          "-u <file>      File holding the token that PUT & POST uploads "
+          "have to send.\n"
+          "-w <seconds>   Time allowed without sending upload data or "
+          "accepting response data, defaults to 30.\n",
           argv[0]);
       exit(EXIT_SUCCESS);
     };
@@ -167,8 +583,26 @@ void parse_args(int argc, char *argv[]) {
   // ':' is required to tell if the flag requires an argument after the flag in
   // cmd line
   int args_parsed = 0; // For debugging
-  while ((arg = getopt(argc, argv, "adhp:r:")) != -1) {
+  while ((arg = getopt(argc, argv, "ab:B:c:dg:hi:m:p:r:t:T:u:w:")) != -1) {
     switch (arg) {
+    case 'b':
+      RATE_LIMIT = strtoul(optarg, NULL, 10) * 1024;
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Connection Bandwidth Limit set to: %lu B/s\n", RATE_LIMIT);
+      break;
+    case 'B':
+      GLOBAL_RATE_LIMIT = strtoul(optarg, NULL, 10) * 1024;
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Global Bandwidth Limit set to: %lu B/s\n", GLOBAL_RATE_LIMIT);
+      break;
+    case 'c':
+      config_path = optarg;
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Config File set to: %s\n", config_path);
+      break;
     case 'd':
       DEBUG = 1;
       args_parsed++;
@@ -178,6 +612,18 @@ void parse_args(int argc, char *argv[]) {
       client_addr_t = INADDR_ANY;
       args_parsed++;
       break;
+    case 'i':
+      index_dir = optarg;
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Index Directory set to: %s\n", index_dir);
+      break;
+    case 'm':
+      CACHE_SIZE = strtoul(optarg, NULL, 10) * 1024 * 1024;
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Cache Size set to: %lu Bytes\n", CACHE_SIZE);
+      break;
     case 'p':
       PORT = atoi(optarg); // 'optarg' is a global variable set by getopt()
       // Have to convert it from ASCII string to integer
@@ -189,15 +635,77 @@ void parse_args(int argc, char *argv[]) {
     case 'r':
       if (!realpath(optarg, root_dir))
         err_n_die("Setting Root Directory");
+      root_arg = optarg;
       args_parsed++;
       if (DEBUG == 1)
         printf("Root Directory set to: %s\n", root_dir);
       break;
+    case 'g':
+      DRAIN_TIMEOUT = strtoul(optarg, NULL, 10);
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Drain Timeout set to: %us\n", DRAIN_TIMEOUT);
+      break;
+    case 't':
+      HEADER_TIMEOUT = strtoul(optarg, NULL, 10);
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Header Timeout set to: %us\n", HEADER_TIMEOUT);
+      break;
+    case 'T':
+      BODY_TIMEOUT = strtoul(optarg, NULL, 10);
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Body Timeout set to: %us\n", BODY_TIMEOUT);
+      break;
+    case 'u': {
+      FILE *token_file = fopen(optarg, "r");
+      if (!token_file)
+        err_n_die("Reading Upload Token");
+      if (!fgets(UPLOAD_TOKEN, TOKEN_SIZE, token_file))
+        UPLOAD_TOKEN[0] = '\0';
+      fclose(token_file);
+      UPLOAD_TOKEN[strcspn(UPLOAD_TOKEN, "\r\n")] = '\0';
+      if (UPLOAD_TOKEN[0] == '\0') {
+        puts("Upload Token File is empty.\n");
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      print_debug("Upload Token Read.\n");
+      break;
+    }
+    case 'w':
+      SEND_TIMEOUT = strtoul(optarg, NULL, 10);
+      args_parsed++;
+      if (DEBUG == 1)
+        printf("Send Timeout set to: %us\n", SEND_TIMEOUT);
+      break;
     case '?': // If an unknown flag or no argument is passed for an option
               // 'optopt' is set to the flag
       if (optopt == 'p')
         puts("Option '-p' requires passing a valid port number\nUse '-h' for "
              "usage.\n");
+      else if (optopt == 'b' || optopt == 'B')
+        printf("Option '-%c' requires passing a bandwidth in KiB/s\nUse '-h' "
+               "for usage.\n",
+               optopt);
+      else if (optopt == 'g' || optopt == 't' || optopt == 'T' ||
+               optopt == 'w')
+        printf("Option '-%c' requires passing a timeout in seconds\nUse '-h' "
+               "for usage.\n",
+               optopt);
+      else if (optopt == 'm')
+        puts("Option '-m' requires passing a cache size in MiB\nUse '-h' for "
+             "usage.\n");
+      else if (optopt == 'c')
+        puts("Option '-c' requires passing a config file path\nUse '-h' for "
+             "usage.\n");
+      else if (optopt == 'u')
+        puts("Option '-u' requires passing a file holding the upload "
+             "token\nUse '-h' for usage.\n");
+      else if (optopt == 'i')
+        puts("Option '-i' requires passing a directory for the index "
+             "files\nUse '-h' for usage.\n");
       else if (optopt == 'r')
         puts(
             "Option '-r' requries passing a valid directory path\nUse '-h' for "
@@ -213,6 +721,12 @@ void parse_args(int argc, char *argv[]) {
     }
   }
 
+  header_timeout_flag = HEADER_TIMEOUT;
+  send_timeout_flag = SEND_TIMEOUT;
+  body_timeout_flag = BODY_TIMEOUT;
+  drain_timeout_flag = DRAIN_TIMEOUT;
+  global_rate_limit_flag = GLOBAL_RATE_LIMIT;
+
   if (DEBUG == 1)
     printf("Parsed %d Argument(s).\n\n", args_parsed);
   return;
@@ -227,6 +741,314 @@ int set_root_dir(void) {
   return 0;
 }
 
+// Hashes a host name with FNV-1a, never returns 0 as it marks empty slots
+uint32_t hash_host(const char *host) {
+  uint32_t hash = 2166136261u;
+  for (; *host; ++host) {
+    hash ^= (unsigned char)*host;
+    hash *= 16777619u;
+  }
+  return hash ? hash : 1;
+}
+
+// Returns the virtual host for a Host header value, which may contain a port
+// and can be in any case. Falls back to 'default_vhost' if no host matches
+struct vhost *find_vhost(const char *host) {
+  if (!host || vhost_names_size == 0)
+    return default_vhost;
+
+  // Lowercasing and dropping the port, keeping the brackets of IPv6 addresses
+  char name[HOST_SIZE];
+  unsigned int len = 0;
+  for (; host[len] && len < HOST_SIZE - 1; ++len) {
+    if (host[len] == ':' && host[0] != '[')
+      break;
+    name[len] = tolower((unsigned char)host[len]);
+    if (host[len] == ']')
+      break;
+  }
+  if (host[len] == ']')
+    len++;
+  name[len] = '\0';
+
+  uint32_t hash = hash_host(name);
+  for (unsigned int i = hash & (vhost_names_size - 1); vhost_names[i].hash;
+       i = (i + 1) & (vhost_names_size - 1))
+    if (vhost_names[i].hash == hash && strcmp(vhost_names[i].name, name) == 0)
+      return &vhosts[vhost_names[i].vhost];
+
+  return default_vhost;
+}
+
+// Parses a listen address: 'port', 'IPv4:port' or '[IPv6]:port'
+// Returns -1 if the address is invalid
+int parse_listen_address(const char *value, struct listener *listener) {
+  char host[INET6_ADDRSTRLEN + 2] = "0.0.0.0";
+  const char *port = value;
+
+  if (value[0] == '[') { // IPv6
+    const char *close_bracket = strchr(value, ']');
+    if (!close_bracket || close_bracket[1] != ':' ||
+        close_bracket - value - 1 >= INET6_ADDRSTRLEN)
+      return -1;
+    snprintf(host, sizeof(host), "%.*s", (int)(close_bracket - value - 1),
+             value + 1);
+    port = close_bracket + 2;
+  } else if (strchr(value, ':')) { // IPv4
+    const char *colon = strchr(value, ':');
+    if (colon - value >= INET6_ADDRSTRLEN)
+      return -1;
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - value), value);
+    port = colon + 1;
+  }
+
+  struct addrinfo hints = {0}, *result;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+  if (getaddrinfo(host, port, &hints, &result) != 0)
+    return -1;
+
+  memcpy(&listener->address, result->ai_addr, result->ai_addrlen);
+  listener->address_len = result->ai_addrlen;
+  listener->fd = -1;
+  freeaddrinfo(result);
+  return 0;
+}
+
+// Reads the config file at 'config_path', if any, and builds the virtual hosts
+// with their lookup table. Hosts are started with a 'host' line listing their
+// names, the 'root', 'cache' & 'rate' lines after it belong to that host. Rest
+// of the lines are global, '#' starts a comment:
+//
+//   listen 127.0.0.1:1419
+//   listen [::1]:1419
+//   header_timeout 10
+//   host example.com www.example.com
+//   root /srv/example
+//   cache max-age=3600
+//   rate 1024
+//
+// 'listen' lines are only used on startup, when 'load_listeners' is 1
+// Without a config file, or without any hosts in it, the only host serves
+// 'root_dir'. Otherwise the first host is the default one
+// Nothing is changed if the file has any errors, returns -1 in that case
+int load_config(int load_listeners) {
+  struct vhost *new_vhosts = NULL;
+  unsigned int new_vhosts_len = 0;
+  struct vhost_name *names = NULL; // Collected first, hashed at the end
+  unsigned int names_len = 0;
+  struct listener new_listeners[MAX_LISTENERS];
+  unsigned int new_listeners_len = 0;
+  unsigned int header_timeout = header_timeout_flag,
+               send_timeout = send_timeout_flag,
+               drain_timeout = drain_timeout_flag,
+               body_timeout = body_timeout_flag;
+  unsigned long global_rate_limit = global_rate_limit_flag;
+
+  FILE *config = NULL;
+  if (config_path && !(config = fopen(config_path, "r"))) {
+    printf("Opening Config File failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  char line[PATH_SIZE + 64];
+  unsigned int line_num = 0;
+  const char *error = NULL;
+
+  while (config && !error && fgets(line, sizeof(line), config)) {
+    line_num++;
+
+    // Dropping comments & trailing whitespace
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+    size_t line_len = strlen(line);
+    while (line_len > 0 && isspace((unsigned char)line[line_len - 1]))
+      line[--line_len] = '\0';
+
+    // Splitting into directive & value
+    char *directive = line;
+    while (isspace((unsigned char)*directive))
+      directive++;
+    if (*directive == '\0')
+      continue;
+    char *value = directive;
+    while (*value && !isspace((unsigned char)*value))
+      value++;
+    if (*value)
+      *value++ = '\0';
+    while (isspace((unsigned char)*value))
+      value++;
+    if (*value == '\0') {
+      error = "Missing value";
+      break;
+    }
+
+    struct vhost *host =
+        new_vhosts_len ? &new_vhosts[new_vhosts_len - 1] : NULL;
+
+    if (strcmp(directive, "listen") == 0) {
+      if (new_listeners_len == MAX_LISTENERS)
+        error = "Too many listeners";
+      else if (parse_listen_address(value, &new_listeners[new_listeners_len]) ==
+               -1)
+        error = "Invalid listen address";
+      else
+        new_listeners_len++;
+    } else if (strcmp(directive, "header_timeout") == 0)
+      header_timeout = strtoul(value, NULL, 10);
+    else if (strcmp(directive, "send_timeout") == 0)
+      send_timeout = strtoul(value, NULL, 10);
+    else if (strcmp(directive, "body_timeout") == 0)
+      body_timeout = strtoul(value, NULL, 10);
+    else if (strcmp(directive, "drain_timeout") == 0)
+      drain_timeout = strtoul(value, NULL, 10);
+    else if (strcmp(directive, "global_rate") == 0)
+      global_rate_limit = strtoul(value, NULL, 10) * 1024;
+    else if (strcmp(directive, "host") == 0) {
+      struct vhost *grown =
+          realloc(new_vhosts, (new_vhosts_len + 1) * sizeof(struct vhost));
+      if (!grown) {
+        error = "Out of memory";
+        break;
+      }
+      new_vhosts = grown;
+      host = &new_vhosts[new_vhosts_len++];
+      host->root[0] = '\0';
+      host->cache_control[0] = '\0';
+      host->rate_limit = RATE_LIMIT;
+      snprintf(host->upload_token, TOKEN_SIZE, "%s", UPLOAD_TOKEN);
+
+      // Every name gets its own slot in the lookup table
+      for (char *name = strtok(value, " \t"); name && !error;
+           name = strtok(NULL, " \t")) {
+        struct vhost_name *grown_names =
+            realloc(names, (names_len + 1) * sizeof(struct vhost_name));
+        if (!grown_names) {
+          error = "Out of memory";
+          break;
+        }
+        names = grown_names;
+        for (char *c = name; *c; ++c)
+          *c = tolower((unsigned char)*c);
+        snprintf(names[names_len].name, HOST_SIZE, "%.*s", HOST_SIZE - 1,
+                 name);
+        names[names_len].hash = hash_host(names[names_len].name);
+        names[names_len].vhost = new_vhosts_len - 1;
+        names_len++;
+      }
+    } else if (strcmp(directive, "root") == 0) {
+      if (!host)
+        error = "'root' outside of a host";
+      else if (!realpath(value, host->root))
+        error = "Root directory does not exist";
+    } else if (strcmp(directive, "cache") == 0) {
+      if (!host)
+        error = "'cache' outside of a host";
+      else
+        snprintf(host->cache_control, CACHE_CONTROL_SIZE, "%.*s",
+                 CACHE_CONTROL_SIZE - 1, value);
+    } else if (strcmp(directive, "rate") == 0) {
+      if (!host)
+        error = "'rate' outside of a host";
+      else
+        host->rate_limit = strtoul(value, NULL, 10) * 1024;
+    } else if (strcmp(directive, "upload_token") == 0) {
+      if (!host)
+        error = "'upload_token' outside of a host";
+      else if (strlen(value) >= TOKEN_SIZE)
+        error = "Upload token is too long";
+      else
+        snprintf(host->upload_token, TOKEN_SIZE, "%.*s", TOKEN_SIZE - 1,
+                 value);
+    } else
+      error = "Unknown directive";
+  }
+
+  if (config)
+    fclose(config);
+
+  // Every host needs a root
+  for (unsigned int i = 0; !error && i < new_vhosts_len; ++i)
+    if (new_vhosts[i].root[0] == '\0') {
+      error = "Host without a root";
+      line_num = 0;
+    }
+
+  // Only host serves the root passed with '-r', or the working directory
+  if (!error && new_vhosts_len == 0) {
+    if (strlen(root_dir) == 0 && set_root_dir() == -1)
+      error = "Setting Root Directory failed";
+    else if (!(new_vhosts = malloc(sizeof(struct vhost))))
+      error = "Out of memory";
+    else {
+      new_vhosts_len = 1;
+      strncpy(new_vhosts->root, root_dir, PATH_SIZE);
+      new_vhosts->cache_control[0] = '\0';
+      new_vhosts->rate_limit = RATE_LIMIT;
+      snprintf(new_vhosts->upload_token, TOKEN_SIZE, "%s", UPLOAD_TOKEN);
+    }
+  }
+
+  // Hashing the names into a table at most half full
+  unsigned int table_size = 0;
+  struct vhost_name *table = NULL;
+  if (!error && names_len > 0) {
+    table_size = 1;
+    while (table_size < names_len * 2)
+      table_size <<= 1;
+    if (!(table = calloc(table_size, sizeof(struct vhost_name))))
+      error = "Out of memory";
+    for (unsigned int i = 0; table && i < names_len; ++i) {
+      unsigned int slot = names[i].hash & (table_size - 1);
+      while (table[slot].hash)
+        slot = (slot + 1) & (table_size - 1);
+      table[slot] = names[i];
+    }
+  }
+  free(names);
+
+  if (error) {
+    if (line_num)
+      printf("Config Error on Line %u: %s\n\n", line_num, error);
+    else
+      printf("Config Error: %s\n\n", error);
+    free(new_vhosts);
+    return -1;
+  }
+
+  // Swapping in the new config
+  free(vhosts);
+  free(vhost_names);
+  vhosts = new_vhosts;
+  vhosts_len = new_vhosts_len;
+  vhost_names = table;
+  vhost_names_size = table_size;
+  default_vhost = &vhosts[0];
+
+  HEADER_TIMEOUT = header_timeout;
+  SEND_TIMEOUT = send_timeout;
+  BODY_TIMEOUT = body_timeout;
+  DRAIN_TIMEOUT = drain_timeout;
+  GLOBAL_RATE_LIMIT = global_rate_limit;
+
+  if (load_listeners) {
+    memcpy(listeners, new_listeners, sizeof(new_listeners));
+    listeners_len = new_listeners_len;
+  } else if (new_listeners_len)
+    print_debug("Listeners are only read on startup, use SIGUSR2 to change "
+                "them.\n");
+
+  if (DEBUG == 1) {
+    printf("Loaded %u Host(s):\n", vhosts_len);
+    for (unsigned int i = 0; i < vhosts_len; ++i)
+      printf("%u. %s\n", i + 1, vhosts[i].root);
+    puts("");
+  }
+  return 0;
+}
+
 // Handles requesting of any static files (currently includes:
 // /favicon.ico, /server.js, /server.html, /404.html
 // Returns 1 if the path has to be dealt with statically and not to be used
@@ -275,6 +1097,105 @@ int simplify_url(struct client_info *client) {
   return 0;
 }
 
+// Copies the value of the request header 'name' into 'value', which can hold
+// 'value_size' chars with the null-terminator. Header names are matched in
+// any case, whitespace around the value is dropped
+// Returns 1 if the header was found, 0 if not
+int get_header(const struct client_info *client, const char *name,
+               char *value, size_t value_size) {
+  size_t name_len = strlen(name);
+
+  // Headers start after the request line, and end at a blank line
+  const char *line = strstr(client->read_buffer, "\r\n");
+  while (line && line[2] != '\r' && line[2] != '\0') {
+    line += 2;
+    const char *line_end = strstr(line, "\r\n");
+    if (!line_end)
+      line_end = line + strlen(line);
+
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *start = line + name_len + 1;
+      while (start < line_end && isspace((unsigned char)*start))
+        start++;
+      const char *end = line_end;
+      while (end > start && isspace((unsigned char)end[-1]))
+        end--;
+      snprintf(value, value_size, "%.*s", (int)(end - start), start);
+      return 1;
+    }
+
+    line = *line_end ? line_end : NULL;
+  }
+
+  return 0;
+}
+
+// Decodes a url-encoded string in place: '%XX' becomes the char it encodes
+// and '+' becomes ' '
+void url_decode(char *str) {
+  char *out = str;
+  for (; *str; ++str, ++out) {
+    if (*str == '%' && isxdigit((unsigned char)str[1]) &&
+        isxdigit((unsigned char)str[2])) {
+      char hex[3] = {str[1], str[2], '\0'};
+      *out = (char)strtol(hex, NULL, 16);
+      str += 2;
+    } else if (*str == '+')
+      *out = ' ';
+    else
+      *out = *str;
+  }
+  *out = '\0';
+}
+
+// Copies the decoded value of the query parameter 'name' into 'value', which
+// can hold 'value_size' chars with the null-terminator
+// Returns 1 if the parameter was found, 0 if not
+int get_query_param(const struct client_info *client, const char *name,
+                    char *value, size_t value_size) {
+  size_t name_len = strlen(name);
+
+  for (const char *param = client->request_query; *param;) {
+    const char *param_end = strchr(param, '&');
+    if (!param_end)
+      param_end = param + strlen(param);
+
+    if (strncmp(param, name, name_len) == 0 &&
+        (param[name_len] == '=' || param + name_len == param_end)) {
+      const char *start =
+          param[name_len] == '=' ? param + name_len + 1 : param_end;
+      snprintf(value, value_size, "%.*s", (int)(param_end - start), start);
+      url_decode(value);
+      return 1;
+    }
+
+    param = *param_end ? param_end + 1 : param_end;
+  }
+
+  return 0;
+}
+
+// Checks if the resolved 'path' is 'root' or inside it
+// '/srv/site-old' is not inside '/srv/site', even though it starts with it
+int path_in_root(const char *path, const char *root) {
+  size_t root_len = strlen(root);
+  if (strncmp(path, root, root_len) != 0)
+    return 0;
+  return root_len == 1 || path[root_len] == '/' || path[root_len] == '\0';
+}
+
+// Checks that an opened file is inside 'root', by the path the kernel has for
+// it, which cannot be swapped out the way a path that is opened by name can
+int fd_in_root(int fd, const char *root) {
+  char fd_path[64], opened_path[PATH_SIZE];
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  ssize_t opened_len = readlink(fd_path, opened_path, PATH_SIZE - 1);
+  if (opened_len == -1)
+    return 0;
+  opened_path[opened_len] = '\0';
+  return path_in_root(opened_path, root);
+}
+
 // Parses a request, extracting the 'request_method' & 'request_path'.
 // Request path is converted to absolute path and checked for traversal
 int parse_request(struct client_info *client) {
@@ -286,6 +1207,14 @@ int parse_request(struct client_info *client) {
              client->request_path) != 2)
     return -1;
 
+  // Splitting off the query, if any
+  client->request_query[0] = '\0';
+  char *query = strchr(client->request_path, '?');
+  if (query) {
+    snprintf(client->request_query, QUERY_SIZE, "%s", query + 1);
+    *query = '\0';
+  }
+
   print_debug("Parsing Request.\n");
 
   if (DEBUG == 1)
@@ -308,6 +1237,13 @@ int parse_request(struct client_info *client) {
 
   print_debug("Request Method is Supported.\n");
 
+  // Picking the virtual host, by the Host header
+  char host[HOST_SIZE];
+  client->vhost =
+      find_vhost(get_header(client, "Host", host, HOST_SIZE) ? host : NULL);
+  if (DEBUG == 1)
+    printf("Serving from Host Root: %s\n", client->vhost->root);
+
   // Taking out any '%20's
   // When user requests for '/', the server should serve pwd
   if (simplify_url(client) == -1)
@@ -323,6 +1259,10 @@ int parse_request(struct client_info *client) {
   printf("(%s) %s %s\n\n", client_ip, client->request_method,
          client->request_path);
 
+  // Uploads resolve their own paths, see handle_upload()
+  if (strcmp(client->request_method, "GET") != 0)
+    return 0;
+
   int is_path_static = check_static_request(client);
 
   // Removing beginning '/'s to be able to use realpath()
@@ -334,16 +1274,17 @@ int parse_request(struct client_info *client) {
     // Thanks Prof Kevin Forest!
     // Getting actual absolute path of the target
 
-    // Have to append the root_dir to request_path, because if root_dir is set
+    // Have to append the host root to request_path, because if root is set
     // with args the realpath() still considers the pwd as the root dir
+    const char *root = client->vhost->root;
     char fullpath[PATH_SIZE]; // This path may be illegal to use, but that
                               // will be sorted later
-    strncpy(fullpath, root_dir, PATH_SIZE); // Starting the path with root dir
+    strncpy(fullpath, root, PATH_SIZE); // Starting the path with root dir
     strcat(fullpath, "/");
     strcat(fullpath, client->request_path); // Now the path will be root(set
                                             // by user)/requested_file
-    // This will work even if the user does not use -r flag, as set_root_dir()
-    // will set the root_dir to pwd
+    // This will work even if the user does not use -r flag, as load_config()
+    // sets the root to pwd
     if (!realpath(fullpath, client->request_path)) {
       // If the errno is set to 2, that means the requested directory/file
       // does not exist Then the server serves the '404.html file instead'
@@ -356,9 +1297,9 @@ int parse_request(struct client_info *client) {
       } else
         return -1;
     } else {
-      // Comparing the starting chars of the 'root_dir' and 'request_path' to
-      // prevent any path traversal
-      if (strncmp(root_dir, client->request_path, strlen(root_dir)) != 0) {
+      // Making sure 'request_path' is still under 'root' to prevent any path
+      // traversal
+      if (!path_in_root(client->request_path, root)) {
         errno = EPERM;
         return -1;
       }
@@ -410,22 +1351,33 @@ char *get_mime_type(const char *filepath) {
 
 // Generates an HTTP response header
 // Defaults to 200, if status is empty
+// 'cache_control' is only sent with 200 responses, and skipped if empty
 int generate_header(char **header, char *status, const char *content_type,
-                    unsigned int content_length, unsigned int *header_size) {
+                    uint64_t content_length, const char *cache_control,
+                    unsigned int *header_size) {
   if (status[0] == '\0')
     snprintf(status, STATUS_SIZE, "200 OK");
 
+  char cache_line[CACHE_CONTROL_SIZE + 32] = "";
+  if (cache_control && cache_control[0] != '\0' &&
+      strcmp(status, "200 OK") == 0)
+    snprintf(cache_line, sizeof(cache_line), "Cache-Control: %s\r\n",
+             cache_control);
+
   const char *header_template =
       "HTTP/1.1 %s\r\n"
       "Content-Type: %s\r\n"
-      "Content-Length: %u\r\n"
+      "Content-Length: %llu\r\n"
+      "%s"
       "Connection: close\r\n"
       "Access-Control-Allow-Origin: *\r\n"
       "Access-Control-Expose-Headers: Content-Type\r\n"
       "\r\n";
 
-  int final_len = snprintf(NULL, 0, header_template, status, content_type,
-                           content_length); // calculating just the final length
+  int final_len =
+      snprintf(NULL, 0, header_template, status, content_type,
+               (unsigned long long)content_length,
+               cache_line); // calculating just the final length
   *header = malloc(final_len + 1);
   if (!*header) {
     errno = ENOMEM;
@@ -434,7 +1386,7 @@ int generate_header(char **header, char *status, const char *content_type,
 
   // Actually adding the response header
   snprintf(*header, final_len + 1, header_template, status, content_type,
-           content_length);
+           (unsigned long long)content_length, cache_line);
   *header_size = final_len;
 
   return 0;
@@ -443,92 +1395,100 @@ int generate_header(char **header, char *status, const char *content_type,
 // Reads a file into the response buffer, to be called in the
 // generate_response()
 // Content type and full HTTP header is set here
-// 'size' is an output variable that is used to output the final size of the
-// response
+// Requested files too big for a cache slot are not read into memory, only the
+// header is put in the response buffer, and the file is left open in
+// 'body_fd' to be sent after it with send_file_body()
 int read_file(struct client_info *client, const char *alternate_path) {
-  FILE *file;
-  if (alternate_path == NULL)
-    file = fopen(client->request_path, "r");
-  else
-    file = fopen(alternate_path, "r");
-
-  if (file == NULL)
+  const char *path =
+      alternate_path == NULL ? client->request_path : alternate_path;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
     return -1;
 
-  fseek(file, 0, SEEK_END);    // Seeking to the end of file
-  long file_len = ftell(file); // Storing length of file
-  rewind(file);                // Rewinding to start to copy the contents
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    close(fd);
+    return -1;
+  }
+  off_t file_len = file_stat.st_size;
 
   char *header;
   unsigned int header_size = 0;
   char *mime = NULL;
-  // Final content length will be 'file_len' when just serving a file
-  // Final content length will be 'file_len + *size' showing a directory,
-  // *size at this point is just the size of 'dirs'
-  if (alternate_path == NULL) {
-    //
-    // Alter code here to add more custom MIME types for static files
-    //
-    char temp_dir[PATH_SIZE] = STATIC_DIR;
-    strncat(temp_dir, "/", PATH_SIZE - (strlen(temp_dir)));
-    if (strcmp(client->request_path,
-               strncat(temp_dir, "server.js", PATH_SIZE - strlen(temp_dir))) ==
-        0)
-      mime = strdup("application/javascript");
-    else
-      mime = get_mime_type(client->request_path);
+  //
+  // Alter code here to add more custom MIME types for static files
+  //
+  char temp_dir[PATH_SIZE] = STATIC_DIR;
+  strncat(temp_dir, "/", PATH_SIZE - (strlen(temp_dir)));
+  if (alternate_path == NULL &&
+      strcmp(client->request_path,
+             strncat(temp_dir, "server.js", PATH_SIZE - strlen(temp_dir))) ==
+          0)
+    mime = strdup("application/javascript");
+  else
+    mime = get_mime_type(path);
 
-    if (!mime)
-      return -1;
-    if (generate_header(&header, client->response_status, mime,
-                        file_len + client->response_len, &header_size) == -1) {
-      fclose(file);
-      free(mime);
-      return -1;
-    }
-  } else {
-    mime = get_mime_type(alternate_path);
-    if (!mime)
-      return -1;
-    if (generate_header(&header, client->response_status, mime,
-                        file_len + client->response_len, &header_size) == -1) {
-      fclose(file);
-      free(mime);
-      return -1;
-    }
+  if (!mime) {
+    close(fd);
+    return -1;
+  }
+  // Final content length will be 'file_len' when just serving a file
+  // Final content length will be 'file_len + response_len' showing a
+  // directory, response_len at this point is just the size of 'dirs'
+  if (generate_header(&header, client->response_status, mime,
+                      (uint64_t)file_len + client->response_len,
+                      client->vhost->cache_control, &header_size) == -1) {
+    close(fd);
+    free(mime);
+    return -1;
   }
   free(mime);
 
+  if (alternate_path == NULL && file_len > CACHE_SLOT_SIZE) {
+    client->response = header;
+    client->response_len = header_size;
+    client->body_fd = fd;
+    client->body_len = file_len;
+    return 0;
+  }
+
   // Response buffer with null-terminator
   client->response = (char *)malloc(file_len + header_size + 1);
 
   if (!(client->response)) {
-    fclose(file);
+    close(fd);
+    free(header);
     errno = ENOMEM; // Errno for malloc errors
     return -1;
   }
 
-  client->response[0] = '\0';
-
   // In case of reading a directory, response_len already has the 'dirs_size'
   // Response started building from here
   // Adding header to the beginning of the response
-  strcat(client->response, header);
+  memcpy(client->response, header, header_size);
 
   // Number of bytes read, used as size of response
   // Reading to the end of header index
-  client->response_len +=
-      fread(&((client->response)[header_size]), sizeof(char), file_len, file);
-  client->response_len += header_size;
+  off_t read_len = 0;
+  while (read_len < file_len) {
+    ssize_t got = read(fd, client->response + header_size + read_len,
+                       file_len - read_len);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0) // Error, or the file shrank
+      break;
+    read_len += got;
+  }
+  client->response_len += read_len + header_size;
 
   // Lesson learned
   // And not using client.response_len as the null terminator position, as it
   // may also contain the dirs_size from read_directory() but not the actual
   // directory data, therefore we get garbage data at the end if I try to
   // print the resposne here. Plus it leads to 'double free' error.
-  (client->response)[file_len + header_size] = '\0';
+  (client->response)[read_len + header_size] = '\0';
 
-  fclose(file);
+  close(fd);
   free(header);
   return 0;
 }
@@ -612,77 +1572,3469 @@ int read_directory(struct client_info *client) {
   return 0;
 }
 
-// Takes in path, checks if it points to a directory or file, call the
-// respective functions to fill the response and sets size of the response
-// buffer Pointer to reponse pointer is required to change the response in the
-// main function
-int generate_response(struct client_info *client) {
-
-  // Metadata of the dir/file
-  struct stat request_path_stat;
-
-  if (stat(client->request_path, &request_path_stat) == -1)
-    return -1;
-  else if (S_ISREG(request_path_stat.st_mode)) { // File
-    if (read_file(client, NULL) == -1)
-      return -1;
-  } else if (S_ISDIR(request_path_stat.st_mode)) { // Directory
-    if (read_directory(client) == -1)
-      return -1;
-  } else {
-    errno = EIO;
-    return -1;
+// Hashes 'len' bytes with 64 bit FNV-1a, continuing from 'hash'
+// Never returns 0, as it marks free cache slots
+uint64_t hash_bytes(uint64_t hash, const void *bytes, size_t len) {
+  const unsigned char *byte = bytes;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= byte[i];
+    hash *= 1099511628211ULL;
   }
-
-  return 0;
+  return hash ? hash : 1;
 }
 
-int main(int argc, char *argv[]) {
-  parse_args(argc,
-             argv); // PORT, root_dir & DEBUG will be set, if passed by user
+// Unlinks a slot from its segment list
+void cache_unlink(int32_t slot) {
+  struct cache_entry *entry = &cache->entries[slot];
+  struct cache_list *list = &cache->segments[entry->segment];
 
-  // This returns a socket file descriptor as an int, which is like a two way
-  // door. This is through which all communication takes place. It takes in
-  // three params:
-  // 1. Address/Protocol family
-  // 2. Socket type (stream or datagram, mainly)
-  // 3. Protocol family (0: OS chooses the appropriate one, TCP for stream
-  // sockets & UDP for datagram sockets)
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-    err_n_die("Creating Socket");
-  print_debug("Socket Created.\n");
-
-  // Now the socket has to be binded to an IP & a port, the address should be
-  // of any one of the interfaces on this machine. After binding all request
-  // to this socket will be routed to that particular IP/port. The address can
-  // be: INADDR_ANY: it is used to target all the avaliable interfaces on the
-  // machine. Localhost: to target localhost, have to use the loopback address
-  // (127.0.0.1) Any IP on the network, also have to convert it to binary form
-  // :: is used to bind to all IPv6 addresses.
-  // Note: Cannot just assign a string IP address to the server, have to
-  // convert it to binary with inet_pton() Also the port has to be  a short in
-  // network byte order(big endian), with htons()
-  server_address.sin_family = AF_INET;
-  server_address.sin_port = htons(PORT);
-  server_address.sin_addr.s_addr = htonl(client_addr_t);
-
-  if (server_address.sin_addr.s_addr == htonl(INADDR_ANY))
-    puts("Server Accepting Incoming Connections from all IPs.\n");
-  else if (server_address.sin_addr.s_addr == htonl(INADDR_LOOPBACK))
-    puts("Server Accepting Incoming Connections from Localhost Only.\n");
+  if (entry->prev != -1)
+    cache->entries[entry->prev].next = entry->next;
   else
-    err_n_die("Binding");
+    list->head = entry->next;
+  if (entry->next != -1)
+    cache->entries[entry->next].prev = entry->prev;
+  else
+    list->tail = entry->prev;
+  list->len--;
+}
 
-  if (bind(server_fd, (struct sockaddr *)&server_address,
-           sizeof(server_address)) == -1)
-    err_n_die("Binding");
-  print_debug("Socket Binded to the port.\n");
+// Links a slot at the most recently used end (head) of a segment list
+void cache_link(int32_t slot, uint8_t segment) {
+  struct cache_entry *entry = &cache->entries[slot];
+  struct cache_list *list = &cache->segments[segment];
 
-  // Now we can start listening with the socket on the ip and port assigned
-  if (listen(server_fd, BACKLOG) == -1)
-    err_n_die("Listening");
+  entry->segment = segment;
+  entry->prev = -1;
+  entry->next = list->head;
+  if (list->head != -1)
+    cache->entries[list->head].prev = slot;
+  else
+    list->tail = slot;
+  list->head = slot;
+  list->len++;
+}
 
-  printf("Server Listening at Port: %d\n", PORT);
+// Frequency of a key, as the smallest of its counters in the sketch
+// Each row of the sketch is indexed with a different part of the key
+unsigned int cache_frequency(uint64_t key) {
+  unsigned int frequency = 15;
+  for (unsigned int row = 0; row < CACHE_SKETCH_ROWS; ++row) {
+    uint32_t index = (uint32_t)((key >> (16 * row)) ^ (key >> 48 << row)) &
+                     (cache->sketch_width - 1);
+    uint8_t count = cache->sketch[row * cache->sketch_width + index];
+    if (count < frequency)
+      frequency = count;
+  }
+  return frequency;
+}
+
+// Counts an access to a key in the sketch, counters stop at 15
+// Once enough accesses are counted, every counter is halved, so the sketch
+// follows what is popular now and not what was popular once
+void cache_count(uint64_t key) {
+  for (unsigned int row = 0; row < CACHE_SKETCH_ROWS; ++row) {
+    uint32_t index = (uint32_t)((key >> (16 * row)) ^ (key >> 48 << row)) &
+                     (cache->sketch_width - 1);
+    uint8_t *count = &cache->sketch[row * cache->sketch_width + index];
+    if (*count < 15)
+      (*count)++;
+  }
+
+  if (++cache->sketch_additions >= cache->slots_len * 10) {
+    for (uint32_t i = 0; i < CACHE_SKETCH_ROWS * cache->sketch_width; ++i)
+      cache->sketch[i] >>= 1;
+    cache->sketch_additions = 0;
+  }
+}
+
+// Removes a slot from the cache, and puts it on the free list
+void cache_evict(int32_t slot) {
+  struct cache_entry *entry = &cache->entries[slot];
+
+  // Removing from its bucket
+  int32_t *link = &cache->buckets[entry->key & (cache->buckets_len - 1)];
+  while (*link != slot)
+    link = &cache->entries[*link].hash_next;
+  *link = entry->hash_next;
+
+  cache_unlink(slot);
+  entry->key = 0;
+  entry->next = cache->free_head;
+  cache->free_head = slot;
+}
+
+// Empties the cache, also used to recover the cache if a process died while
+// changing it
+void cache_clear(void) {
+  for (uint32_t i = 0; i < cache->buckets_len; ++i)
+    cache->buckets[i] = -1;
+  for (uint8_t segment = 0; segment < CACHE_SEGMENTS; ++segment) {
+    cache->segments[segment].head = cache->segments[segment].tail = -1;
+    cache->segments[segment].len = 0;
+  }
+  for (uint32_t i = 0; i < cache->slots_len; ++i) {
+    cache->entries[i].key = 0;
+    cache->entries[i].next = i + 1 < cache->slots_len ? (int32_t)i + 1 : -1;
+  }
+  cache->free_head = 0;
+  memset(cache->sketch, 0, CACHE_SKETCH_ROWS * cache->sketch_width);
+  cache->sketch_additions = 0;
+}
+
+// Locks the cache, every process uses the same mutex in the shared mapping
+// The mutex is robust, if a process dies holding it (e.g., a connection
+// terminated while draining), the next one gets it and clears the cache as it
+// may have been left half changed
+int cache_lock(void) {
+  int result = pthread_mutex_lock(&cache->lock);
+  if (result == EOWNERDEAD) {
+    cache_clear();
+    pthread_mutex_consistent(&cache->lock);
+  } else if (result != 0)
+    return -1;
+  return 0;
+}
+
+// Maps the shared cache of 'CACHE_SIZE' bytes, has to be called before forking
+// Cache is made of fixed size slots, each holding the path and the whole
+// response (header & body) of one file
+// Eviction follows W-TinyLFU: new files go in a small window LRU, files
+// leaving the window only get into the main SLRU (probation & protected) if
+// they were asked for more often than the file they would replace, going by a
+// count-min sketch of recent accesses
+int cache_init(void) {
+  uint32_t slots_len = CACHE_SIZE / CACHE_SLOT_SIZE;
+  if (slots_len < 2) // Window & main need a slot each
+    return 0;
+
+  uint32_t buckets_len = 1, sketch_width = 1;
+  while (buckets_len < slots_len)
+    buckets_len <<= 1;
+  while (sketch_width < slots_len * 4)
+    sketch_width <<= 1;
+
+  size_t entries_offset = sizeof(struct cache);
+  size_t buckets_offset =
+      entries_offset + slots_len * sizeof(struct cache_entry);
+  size_t sketch_offset = buckets_offset + buckets_len * sizeof(int32_t);
+  size_t data_offset = sketch_offset + CACHE_SKETCH_ROWS * sketch_width;
+  data_offset = (data_offset + 63) & ~(size_t)63;
+
+  void *region =
+      mmap(NULL, data_offset + (size_t)slots_len * CACHE_SLOT_SIZE,
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return -1;
+
+  cache = region;
+  cache->entries = (struct cache_entry *)((char *)region + entries_offset);
+  cache->buckets = (int32_t *)((char *)region + buckets_offset);
+  cache->sketch = (uint8_t *)region + sketch_offset;
+  cache->data = (char *)region + data_offset;
+  cache->slots_len = slots_len;
+  cache->buckets_len = buckets_len;
+  cache->sketch_width = sketch_width;
+  // Window gets 1% of the slots, protected 80% of the rest
+  cache->window_max = slots_len / 100 ? slots_len / 100 : 1;
+  cache->protected_max = (slots_len - cache->window_max) * 4 / 5;
+
+  pthread_mutexattr_t lock_attr;
+  pthread_mutexattr_init(&lock_attr);
+  pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
+  int result = pthread_mutex_init(&cache->lock, &lock_attr);
+  pthread_mutexattr_destroy(&lock_attr);
+  if (result != 0) {
+    errno = result;
+    return -1;
+  }
+
+  cache_clear();
+
+  if (DEBUG == 1)
+    printf("Cache Mapped with %u Slots of %d Bytes.\n", slots_len,
+           CACHE_SLOT_SIZE);
+  return 0;
+}
+
+// Key of a cached response, the same file can be served with different
+// Cache-Control headers by different hosts
+uint64_t cache_key(const struct client_info *client) {
+  uint64_t key = hash_bytes(14695981039346656037ULL, client->request_path,
+                            strlen(client->request_path) + 1);
+  return hash_bytes(key, client->vhost->cache_control,
+                    strlen(client->vhost->cache_control));
+}
+
+// Returns the slot holding 'path' under 'key', or -1 if it is not cached
+// Cache has to be locked
+int32_t cache_find(uint64_t key, const char *path, size_t path_len) {
+  int32_t slot = cache->buckets[key & (cache->buckets_len - 1)];
+  for (; slot != -1; slot = cache->entries[slot].hash_next)
+    if (cache->entries[slot].key == key &&
+        cache->entries[slot].path_len == path_len &&
+        memcmp(cache->data + (size_t)slot * CACHE_SLOT_SIZE, path, path_len) ==
+            0)
+      break;
+  return slot;
+}
+
+// Looks for the response of the requested file in the cache, the file is
+// described by 'file_stat' and the cached response is only used if the file
+// has not changed since
+// On a hit, the response is copied out to 'cache_hit_buffer', so the file is
+// never opened. Returns 1 on a hit and 0 on a miss
+int cache_lookup(struct client_info *client, const struct stat *file_stat) {
+  if (!cache)
+    return 0;
+
+  uint64_t key = cache_key(client);
+  size_t path_len = strlen(client->request_path) + 1;
+
+  if (cache_lock() == -1)
+    return 0;
+
+  cache_count(key);
+
+  int32_t slot = cache_find(key, client->request_path, path_len);
+  if (slot == -1) {
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+  }
+
+  struct cache_entry *entry = &cache->entries[slot];
+  if (entry->mtime.tv_sec != file_stat->st_mtim.tv_sec ||
+      entry->mtime.tv_nsec != file_stat->st_mtim.tv_nsec ||
+      entry->size != file_stat->st_size || entry->inode != file_stat->st_ino ||
+      entry->device != file_stat->st_dev) {
+    // File changed, dropping the stale response
+    cache_evict(slot);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+  }
+
+  memcpy(cache_hit_buffer,
+         cache->data + (size_t)slot * CACHE_SLOT_SIZE + path_len,
+         entry->response_len);
+  client->response = cache_hit_buffer;
+  client->response_len = entry->response_len;
+
+  // Updating recency, a second hit on probation earns a protected spot
+  if (entry->segment == CACHE_WINDOW || entry->segment == CACHE_PROTECTED) {
+    cache_unlink(slot);
+    cache_link(slot, entry->segment);
+  } else {
+    cache_unlink(slot);
+    cache_link(slot, CACHE_PROTECTED);
+    if (cache->segments[CACHE_PROTECTED].len > cache->protected_max) {
+      int32_t demoted = cache->segments[CACHE_PROTECTED].tail;
+      cache_unlink(demoted);
+      cache_link(demoted, CACHE_PROBATION);
+    }
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+  print_debug("Response Served from Cache.\n");
+  return 1;
+}
+
+// Frees a slot when the cache is full
+// The oldest file of the window (candidate) is up against the oldest file of
+// the main part (victim), the one asked for less often is evicted
+// The candidate, if it wins, moves into probation
+void cache_make_room(void) {
+  struct cache_list *window = &cache->segments[CACHE_WINDOW];
+  int32_t victim = cache->segments[CACHE_PROBATION].tail;
+  if (victim == -1)
+    victim = cache->segments[CACHE_PROTECTED].tail;
+
+  if (window->len < cache->window_max || victim == -1) {
+    // Window has room to grow, or there is no main part yet
+    cache_evict(victim != -1 ? victim : window->tail);
+    return;
+  }
+
+  int32_t candidate = window->tail;
+  if (cache_frequency(cache->entries[candidate].key) >
+      cache_frequency(cache->entries[victim].key)) {
+    cache_evict(victim);
+    cache_unlink(candidate);
+    cache_link(candidate, CACHE_PROBATION);
+  } else
+    cache_evict(candidate);
+}
+
+// Stores the response generated for the requested file, if it fits in a slot
+// with the path. Only whole 200 responses of regular files are stored
+void cache_insert(struct client_info *client, const struct stat *file_stat) {
+  size_t path_len = strlen(client->request_path) + 1;
+
+  if (!cache || strcmp(client->response_status, "200 OK") != 0 ||
+      client->body_fd != -1 ||
+      path_len + client->response_len > CACHE_SLOT_SIZE)
+    return;
+
+  uint64_t key = cache_key(client);
+
+  if (cache_lock() == -1)
+    return;
+
+  // Another process may have stored it already
+  int32_t slot = cache_find(key, client->request_path, path_len);
+  if (slot != -1)
+    cache_evict(slot);
+
+  if (cache->free_head == -1)
+    cache_make_room();
+  slot = cache->free_head;
+  cache->free_head = cache->entries[slot].next;
+
+  struct cache_entry *entry = &cache->entries[slot];
+  entry->key = key;
+  entry->path_len = path_len;
+  entry->response_len = client->response_len;
+  entry->mtime = file_stat->st_mtim;
+  entry->size = file_stat->st_size;
+  entry->inode = file_stat->st_ino;
+  entry->device = file_stat->st_dev;
+
+  char *data = cache->data + (size_t)slot * CACHE_SLOT_SIZE;
+  memcpy(data, client->request_path, path_len);
+  memcpy(data + path_len, client->response, client->response_len);
+
+  int32_t *bucket = &cache->buckets[key & (cache->buckets_len - 1)];
+  entry->hash_next = *bucket;
+  *bucket = slot;
+  cache_link(slot, CACHE_WINDOW);
+
+  // Window over its share, while there is still free room, moving its
+  // oldest file into probation
+  if (cache->segments[CACHE_WINDOW].len > cache->window_max &&
+      cache->free_head != -1) {
+    int32_t oldest = cache->segments[CACHE_WINDOW].tail;
+    cache_unlink(oldest);
+    cache_link(oldest, CACHE_PROBATION);
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+  print_debug("Response Stored in Cache.\n");
+}
+
+// Returns the current time of the monotonic clock in nanoseconds
+uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Books 'bytes' worth of time on a send clock and returns the time at which
+// the booking starts, a clock simply holds the time it is booked up to.
+// A clock that has fallen behind the present is restarted from the present, so
+// idle time is not saved up as a burst.
+// The global clock lives in shared memory and is booked with compare and
+// swap, every connection books one chunk at a time, so the big transfers take
+// turns on the global clock in round-robin
+uint64_t book_send_clock(uint64_t *clock, int shared, size_t bytes,
+                         unsigned long rate) {
+  uint64_t now = monotonic_ns();
+  uint64_t cost = (uint64_t)bytes * 1000000000ULL / rate;
+
+  if (!shared) {
+    uint64_t start = *clock > now ? *clock : now;
+    *clock = start + cost;
+    return start;
+  }
+
+  uint64_t booked = __atomic_load_n(clock, __ATOMIC_RELAXED);
+  uint64_t start;
+  do
+    start = booked > now ? booked : now;
+  while (!__atomic_compare_exchange_n(clock, &booked, start + cost, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return start;
+}
+
+// Sleeps until the connection is allowed to send the next 'bytes', waiting on
+// both the per-connection and the global clocks
+void wait_send_turn(struct client_info *client, size_t bytes) {
+  uint64_t turn = 0;
+
+  unsigned long rate_limit = client->vhost->rate_limit;
+  if (rate_limit)
+    turn = book_send_clock(&client->next_send_ns, 0, bytes, rate_limit);
+
+  if (GLOBAL_RATE_LIMIT && global_send_ns) {
+    uint64_t global_turn =
+        book_send_clock(global_send_ns, 1, bytes, GLOBAL_RATE_LIMIT);
+    if (global_turn > turn)
+      turn = global_turn;
+  }
+
+  if (turn <= monotonic_ns())
+    return;
+
+  struct timespec wake = {.tv_sec = turn / 1000000000ULL,
+                          .tv_nsec = turn % 1000000000ULL};
+  // Restarting the sleep if a signal interrupts it, unless shutting down
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) ==
+             EINTR &&
+         running)
+    ;
+}
+
+// Reads the request headers into 'read_buffer', until the blank line ending
+// them is received or the buffer is full
+// The whole header has to arrive within HEADER_TIMEOUT seconds, no matter how
+// the client trickles it in, so slow clients cannot hold a process forever
+// Returns -1 with errno set to ETIMEDOUT if the deadline passes, and to
+// ECONNRESET if the client closes the connection before sending a header
+int read_request(struct client_info *client) {
+  uint64_t deadline = monotonic_ns() + (uint64_t)HEADER_TIMEOUT * 1000000000ULL;
+  client->request_len = 0;
+  client->read_buffer[0] = '\0';
+
+  while (client->request_len < READ_BUFFER_SIZE - 1) {
+    uint64_t now = monotonic_ns();
+    if (now >= deadline) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    struct pollfd client_poll = {.fd = client->client_fd, .events = POLLIN};
+    int ready = poll(&client_poll, 1, (deadline - now + 999999) / 1000000);
+    if (ready == -1) {
+      if (errno == EINTR && running)
+        continue;
+      return -1;
+    }
+    if (ready == 0)
+      continue; // Deadline is checked at the top
+
+    // 1 less for the null-terminator
+    ssize_t bytes_read =
+        read(client->client_fd, client->read_buffer + client->request_len,
+             READ_BUFFER_SIZE - 1 - client->request_len);
+    if (bytes_read == -1) {
+      if (errno == EINTR && running)
+        continue;
+      return -1;
+    }
+    if (bytes_read == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+
+    client->request_len += bytes_read;
+    client->read_buffer[client->request_len] = '\0';
+
+    // Only the newly read part and the 3 chars before it have to be checked
+    unsigned int search_from = client->request_len - bytes_read;
+    search_from = search_from > 3 ? search_from - 3 : 0;
+    if (strstr(client->read_buffer + search_from, "\r\n\r\n"))
+      return 0;
+  }
+
+  // Buffer is full, the request line has been read for sure
+  return 0;
+}
+
+// Writes 'iovcnt' buffers to the client, taking care of partial writes
+// Responses that fit in one SEND_CHUNK_SIZE are written right away, so small
+// requests never wait behind big transfers. Bigger responses are written one
+// chunk at a time, each chunk waiting for its turn with wait_send_turn()
+// 'iov' is used as scratch space and is changed
+int send_response(struct client_info *client, struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; ++i)
+    total += iov[i].iov_len;
+
+  int shaped = total > SEND_CHUNK_SIZE &&
+               (client->vhost->rate_limit || GLOBAL_RATE_LIMIT);
+  size_t paid = 0; // Bytes of the current chunk that have been waited for
+
+  while (iovcnt > 0) {
+    // Skipping buffers that are fully written
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+
+    // Cutting the buffers down to one chunk, or to the part of the current
+    // chunk that has been waited for but not written yet
+    size_t limit = paid ? paid : SEND_CHUNK_SIZE;
+    struct iovec chunk[iovcnt];
+    size_t chunk_len = 0;
+    int chunk_cnt = 0;
+    for (; chunk_cnt < iovcnt && chunk_len < limit; ++chunk_cnt) {
+      chunk[chunk_cnt] = iov[chunk_cnt];
+      if (chunk_len + chunk[chunk_cnt].iov_len > limit)
+        chunk[chunk_cnt].iov_len = limit - chunk_len;
+      chunk_len += chunk[chunk_cnt].iov_len;
+    }
+
+    if (shaped && paid == 0) {
+      wait_send_turn(client, chunk_len);
+      paid = chunk_len;
+    }
+
+    ssize_t written = writev(client->client_fd, chunk, chunk_cnt);
+    if (written == -1) {
+      if (errno == EINTR && running)
+        continue;
+      // SO_SNDTIMEO ran out without the client accepting any data
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        errno = ETIMEDOUT;
+      return -1;
+    }
+
+    if (shaped)
+      paid -= written;
+
+    // Moving past the written bytes
+    while (written > 0) {
+      if ((size_t)written < iov->iov_len) {
+        iov->iov_base = (char *)iov->iov_base + written;
+        iov->iov_len -= written;
+        break;
+      }
+      written -= iov->iov_len;
+      iov->iov_len = 0;
+      iov++;
+      iovcnt--;
+    }
+  }
+
+  return 0;
+}
+
+// Sends 'len' bytes of a file to the client, from where the file is at, with
+// sendfile() so the data never passes through the process. Shaped the same
+// way as send_response(), one chunk at a time
+// If the file shrank since its size was promised, the rest is sent as zeros
+int send_file_body(struct client_info *client, int file_fd, uint64_t len) {
+  int shaped = client->vhost->rate_limit || GLOBAL_RATE_LIMIT;
+  uint64_t sent_len = 0;
+
+  while (sent_len < len) {
+    size_t chunk =
+        len - sent_len < SEND_CHUNK_SIZE ? len - sent_len : SEND_CHUNK_SIZE;
+    if (shaped)
+      wait_send_turn(client, chunk);
+
+    ssize_t sent = sendfile(client->client_fd, file_fd, NULL, chunk);
+    if (sent == -1) {
+      if (errno == EINTR && running)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        errno = ETIMEDOUT;
+      return -1;
+    }
+    sent_len += sent;
+    if (sent == 0) { // File shrank
+      static const char zeros[4096];
+      while (sent_len < len) {
+        size_t zeros_len =
+            len - sent_len < sizeof(zeros) ? len - sent_len : sizeof(zeros);
+        struct iovec zeros_iov = {(void *)zeros, zeros_len};
+        if (send_response(client, &zeros_iov, 1) == -1)
+          return -1;
+        sent_len += zeros_len;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// State of a tar archive being streamed to a client, with chunked encoding
+// Tar headers & padding are collected in 'buffer' and sent as one chunk, file
+// bodies are sent as chunks of their own, straight from the file
+struct archive {
+  struct client_info *client;
+  char buffer[ARCHIVE_BUFFER_SIZE];
+  size_t len;
+  int crlf_pending; // A file chunk was sent, its ending CRLF was not yet
+};
+
+// Sends the buffered data as a chunk, and opens a chunk of 'next_chunk_len'
+// bytes for a file body, if not 0. All of it goes out in a single writev
+int archive_flush(struct archive *archive, uint64_t next_chunk_len) {
+  char prefix[32], suffix[32];
+  int prefix_len = 0, suffix_len = 0;
+
+  if (archive->crlf_pending)
+    prefix_len += snprintf(prefix, sizeof(prefix), "\r\n");
+  if (archive->len)
+    prefix_len += snprintf(prefix + prefix_len, sizeof(prefix) - prefix_len,
+                           "%zx\r\n", archive->len);
+  if (archive->len)
+    suffix_len += snprintf(suffix, sizeof(suffix), "\r\n");
+  if (next_chunk_len)
+    suffix_len += snprintf(suffix + suffix_len, sizeof(suffix) - suffix_len,
+                           "%llx\r\n", (unsigned long long)next_chunk_len);
+
+  struct iovec iov[3] = {{prefix, prefix_len},
+                         {archive->buffer, archive->len},
+                         {suffix, suffix_len}};
+  if (send_response(archive->client, iov, 3) == -1)
+    return -1;
+
+  archive->len = 0;
+  archive->crlf_pending = next_chunk_len != 0;
+  return 0;
+}
+
+// Adds 'len' bytes to the buffer, flushing it when full
+int archive_write(struct archive *archive, const void *data, size_t len) {
+  while (len > 0) {
+    size_t space = ARCHIVE_BUFFER_SIZE - archive->len;
+    size_t copy = len < space ? len : space;
+    if (data)
+      memcpy(archive->buffer + archive->len, data, copy);
+    else
+      memset(archive->buffer + archive->len, 0, copy); // NULL writes zeros
+    archive->len += copy;
+    len -= copy;
+    if (data)
+      data = (const char *)data + copy;
+
+    if (archive->len == ARCHIVE_BUFFER_SIZE && archive_flush(archive, 0) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+// Adds one "length key=value\n" record of a pax extended header to 'records'
+// The length counts itself, so it is worked out digit by digit
+size_t pax_record(char *records, size_t size, const char *key,
+                  const char *value) {
+  size_t len = strlen(key) + strlen(value) + 3; // ' ', '=' & '\n'
+  size_t digits = 1;
+  while (snprintf(NULL, 0, "%zu", len + digits) > (int)digits)
+    digits++;
+  return snprintf(records, size, "%zu %s=%s\n", len + digits, key, value);
+}
+
+// Fills a ustar header block, the checksum is computed with the checksum
+// field taken as spaces
+void tar_block(char block[512], const char *name, const char *prefix,
+               const struct stat *entry_stat, uint64_t size, char typeflag,
+               const char *linkname) {
+  memset(block, 0, 512);
+  snprintf(block, 100, "%s", name);
+  snprintf(block + 100, 8, "%07o", (unsigned int)entry_stat->st_mode & 07777);
+  snprintf(block + 108, 8, "%07o", (unsigned int)entry_stat->st_uid & 07777777);
+  snprintf(block + 116, 8, "%07o", (unsigned int)entry_stat->st_gid & 07777777);
+  // Sizes too big for 11 octal digits are given in a pax header instead
+  snprintf(block + 124, 12, "%011llo",
+           (unsigned long long)(size < 077777777777ULL ? size : 0));
+  snprintf(block + 136, 12, "%011llo",
+           (unsigned long long)entry_stat->st_mtime & 077777777777ULL);
+  memset(block + 148, ' ', 8);
+  block[156] = typeflag;
+  snprintf(block + 157, 100, "%s", linkname ? linkname : "");
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  snprintf(block + 345, 155, "%s", prefix ? prefix : "");
+
+  unsigned int checksum = 0;
+  for (int i = 0; i < 512; ++i)
+    checksum += (unsigned char)block[i];
+  snprintf(block + 148, 8, "%06o", checksum);
+  block[155] = ' ';
+}
+
+// Adds the header of an entry to the archive
+// Paths that do not fit in the 100 char name (or the 155 char prefix and 100
+// char name), long link targets & big sizes are given in a pax header first
+int archive_header(struct archive *archive, const char *path,
+                   const struct stat *entry_stat, uint64_t size, char typeflag,
+                   const char *linkname) {
+  char block[512];
+  size_t path_len = strlen(path);
+
+  // Splitting the path at a '/' into prefix & name, if it is too long
+  char prefix[156] = "";
+  const char *name = path;
+  if (path_len > 99) {
+    const char *split = path + path_len - 100;
+    while (*split && *split != '/')
+      split++;
+    if (*split == '/' && split - path < 155) {
+      snprintf(prefix, sizeof(prefix), "%.*s", (int)(split - path), path);
+      name = split + 1;
+    }
+  }
+
+  int needs_pax = (name == path && path_len > 99) ||
+                  (linkname && strlen(linkname) > 99) ||
+                  size >= 077777777777ULL;
+  if (needs_pax) {
+    char records[2 * PATH_SIZE + 128];
+    size_t records_len = 0;
+    records_len += pax_record(records, sizeof(records), "path", path);
+    if (linkname)
+      records_len += pax_record(records + records_len,
+                                sizeof(records) - records_len, "linkpath",
+                                linkname);
+    char size_str[24];
+    snprintf(size_str, sizeof(size_str), "%llu", (unsigned long long)size);
+    records_len += pax_record(records + records_len,
+                              sizeof(records) - records_len, "size", size_str);
+    if (records_len >= sizeof(records))
+      records_len = sizeof(records) - 1;
+
+    tar_block(block, "PaxHeader", NULL, entry_stat, records_len, 'x', NULL);
+    if (archive_write(archive, block, 512) == -1 ||
+        archive_write(archive, records, records_len) == -1 ||
+        archive_write(archive, NULL, (512 - records_len % 512) % 512) == -1)
+      return -1;
+  }
+
+  tar_block(block, name, prefix, entry_stat, size, typeflag, linkname);
+  return archive_write(archive, block, 512);
+}
+
+// Adds one directory entry to the archive, 'dir_fd' is the directory it is
+// in and 'path' its path in the archive
+// Symlinks are stored as links and never followed, and every file is opened
+// relative to its directory with O_NOFOLLOW, so the walk cannot leave the
+// requested directory, even if the tree changes while it is walked
+// Returns the fd of the entry if it is a directory to walk into, -1 if not,
+// and -2 on errors sending the archive
+int archive_entry(struct archive *archive, int dir_fd, const char *name,
+                  const char *path) {
+  struct stat entry_stat;
+  if (fstatat(dir_fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW) == -1)
+    return -1; // Gone since it was listed
+
+  if (S_ISDIR(entry_stat.st_mode)) {
+    int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (sub_fd == -1)
+      return -1;
+    char dir_path[PATH_SIZE + 1];
+    snprintf(dir_path, sizeof(dir_path), "%s/", path);
+    if (archive_header(archive, dir_path, &entry_stat, 0, '5', NULL) == -1) {
+      close(sub_fd);
+      return -2;
+    }
+    return sub_fd;
+  }
+
+  if (S_ISLNK(entry_stat.st_mode)) {
+    char target[PATH_SIZE];
+    ssize_t target_len = readlinkat(dir_fd, name, target, PATH_SIZE - 1);
+    if (target_len == -1)
+      return -1;
+    target[target_len] = '\0';
+    return archive_header(archive, path, &entry_stat, 0, '2', target) == -1
+               ? -2
+               : -1;
+  }
+
+  if (!S_ISREG(entry_stat.st_mode)) // Devices, sockets & pipes are skipped
+    return -1;
+
+  int file_fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+  if (file_fd == -1)
+    return -1;
+  // Size of the opened file, it may have changed since fstatat()
+  if (fstat(file_fd, &entry_stat) == -1 || !S_ISREG(entry_stat.st_mode)) {
+    close(file_fd);
+    return -1;
+  }
+
+  uint64_t size = entry_stat.st_size;
+  int result = archive_header(archive, path, &entry_stat, size, '0', NULL);
+  // A chunk of size 0 would end the response, empty files have no body
+  if (result == 0 && size > 0)
+    result = archive_flush(archive, size) == -1 ||
+                     send_file_body(archive->client, file_fd, size) == -1 ||
+                     archive_write(archive, NULL, (512 - size % 512) % 512) ==
+                         -1
+                 ? -1
+                 : 0;
+  close(file_fd);
+
+  return result == -1 ? -2 : -1;
+}
+
+// Streams the requested directory as a tar archive, with chunked encoding as
+// the size is not known up front
+// The tree is walked depth first with a stack of open directories, so memory
+// use only grows with the depth of the tree and not with its size
+// Reuses the opendir()/readdir() walk of read_directory(), without following
+// any symlinks, see archive_entry()
+int stream_archive(struct client_info *client) {
+  // Archive is named after the directory, and every path in it starts with
+  // the directory's name
+  const char *dir_name = strrchr(client->request_path, '/');
+  dir_name = dir_name && dir_name[1] ? dir_name + 1 : "root";
+  char archive_name[NAME_MAX + 1];
+  snprintf(archive_name, sizeof(archive_name), "%s", dir_name);
+  for (char *c = archive_name; *c; ++c)
+    if (*c == '"' || *c == '\\' || iscntrl((unsigned char)*c))
+      *c = '_';
+
+  DIR *dirs[ARCHIVE_MAX_DEPTH];
+  size_t path_lens[ARCHIVE_MAX_DEPTH];
+  int depth = 0;
+
+  // A whole tree is sent, so the directory that got opened is checked
+  // against the host root again, in case the path changed since
+  // parse_request() resolved it
+  int root_fd = open(client->request_path, O_RDONLY | O_DIRECTORY);
+  if (root_fd == -1)
+    return -1;
+  if (!fd_in_root(root_fd, client->vhost->root)) {
+    close(root_fd);
+    errno = EPERM;
+    return -1;
+  }
+  if (!(dirs[0] = fdopendir(root_fd))) {
+    close(root_fd);
+    return -1;
+  }
+
+  struct archive *archive = malloc(sizeof(struct archive));
+  if (!archive) {
+    closedir(dirs[0]);
+    errno = ENOMEM;
+    return -1;
+  }
+  archive->client = client;
+  archive->len = 0;
+  archive->crlf_pending = 0;
+
+  char header[512];
+  int header_len = snprintf(
+      header, sizeof(header),
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: application/x-tar\r\n"
+      "Content-Disposition: attachment; filename=\"%s.tar\"\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Connection: close\r\n"
+      "Access-Control-Allow-Origin: *\r\n"
+      "Access-Control-Expose-Headers: Content-Type\r\n"
+      "\r\n",
+      archive_name);
+  struct iovec header_iov = {header, header_len};
+  int result = send_response(client, &header_iov, 1);
+
+  char path[PATH_SIZE];
+  snprintf(path, PATH_SIZE, "%s", archive_name);
+  path_lens[0] = strlen(path);
+
+  struct stat root_stat;
+  if (result == 0 && fstat(root_fd, &root_stat) == 0) {
+    char root_path[PATH_SIZE + 1];
+    snprintf(root_path, sizeof(root_path), "%s/", path);
+    result = archive_header(archive, root_path, &root_stat, 0, '5', NULL);
+  }
+
+  while (result == 0 && depth >= 0) {
+    struct dirent *dir_entry = readdir(dirs[depth]);
+    if (!dir_entry) { // Done with this directory
+      closedir(dirs[depth]);
+      depth--;
+      continue;
+    }
+
+    // Not adding back and current directories
+    char *file_name = dir_entry->d_name;
+    if (strcmp(file_name, "..") == 0 || strcmp(file_name, ".") == 0)
+      continue;
+
+    // Entries with paths too long to be extracted anyway are skipped
+    path[path_lens[depth]] = '\0';
+    if (path_lens[depth] + 1 + strlen(file_name) >= PATH_SIZE)
+      continue;
+    snprintf(path + path_lens[depth], PATH_SIZE - path_lens[depth], "/%s",
+             file_name);
+
+    int sub_fd = archive_entry(archive, dirfd(dirs[depth]), file_name, path);
+    if (sub_fd == -2) {
+      result = -1;
+      break;
+    }
+    if (sub_fd < 0)
+      continue;
+
+    // Walking into the directory, unless the tree is too deep
+    if (depth + 1 == ARCHIVE_MAX_DEPTH ||
+        !(dirs[depth + 1] = fdopendir(sub_fd))) {
+      close(sub_fd);
+      continue;
+    }
+    depth++;
+    path_lens[depth] = strlen(path);
+  }
+
+  // Ending the archive with two zero blocks, and the response with an empty
+  // chunk
+  if (result == 0 && archive_write(archive, NULL, 1024) == 0 &&
+      archive_flush(archive, 0) == 0) {
+    struct iovec end_iov = {"0\r\n\r\n", 5};
+    result = send_response(client, &end_iov, 1);
+  } else
+    result = -1;
+
+  int saved_errno = errno;
+  for (; depth >= 0; --depth)
+    closedir(dirs[depth]);
+  free(archive);
+  errno = saved_errno;
+
+  // A download the client gave up on is not an error of the server
+  if (result == -1 &&
+      (errno == EPIPE || errno == ECONNRESET || errno == ETIMEDOUT)) {
+    print_debug("Client Stopped Receiving the Archive.\n");
+    return 0;
+  }
+
+  print_debug("Archive Streamed.\n");
+  return result;
+}
+
+// Path of the index file of 'root', named after a hash of the root
+void index_file_path(const char *root, char *path) {
+  snprintf(path, PATH_SIZE, "%s/server-c-%016llx.index", index_dir,
+           (unsigned long long)hash_bytes(14695981039346656037ULL, root,
+                                          strlen(root)));
+}
+
+// Lowercases 'name' into 'lower', which holds NAME_MAX + 1 chars
+// Returns the length of 'lower'
+size_t index_lower(const char *name, char *lower) {
+  size_t len = 0;
+  for (; name[len] && len < NAME_MAX; ++len)
+    lower[len] = tolower((unsigned char)name[len]);
+  lower[len] = '\0';
+  return len;
+}
+
+// Fills 'trigrams' with the distinct trigrams of a lowercased name, 3 chars
+// packed into an integer, and returns how many there are
+// 'trigrams' holds NAME_MAX of them
+unsigned int index_trigrams(const char *lower, size_t len, uint32_t *trigrams) {
+  unsigned int count = 0;
+  for (size_t i = 0; i + 3 <= len; ++i) {
+    uint32_t trigram = (uint32_t)(unsigned char)lower[i] << 16 |
+                       (uint32_t)(unsigned char)lower[i + 1] << 8 |
+                       (unsigned char)lower[i + 2];
+    unsigned int seen = 0;
+    while (seen < count && trigrams[seen] != trigram)
+      seen++;
+    if (seen == count)
+      trigrams[count++] = trigram;
+  }
+  return count;
+}
+
+// Identity of an index file for 'index_checked', an index file is never
+// changed in place, so a new inode or mtime means a new file
+uint64_t index_identity(const struct stat *file_stat) {
+  uint64_t hash = 14695981039346656037ULL;
+  hash = hash_bytes(hash, &file_stat->st_dev, sizeof(file_stat->st_dev));
+  hash = hash_bytes(hash, &file_stat->st_ino, sizeof(file_stat->st_ino));
+  hash = hash_bytes(hash, &file_stat->st_size, sizeof(file_stat->st_size));
+  return hash_bytes(hash, &file_stat->st_mtim, sizeof(file_stat->st_mtim));
+}
+
+// Sets the parts of 'view' from a mapped index file, checking that the file
+// is complete and that it is the index of 'root'
+// Every entry is only checked the first time a file with 'identity' is seen,
+// later searches on the same file just check the header. 0 always checks
+// Returns 0 if the file can be used, -1 if not
+int index_view(const char *map, size_t size, const char *root,
+               uint64_t identity, struct index_view *view) {
+  const struct index_header *header = (const struct index_header *)map;
+  if (size < sizeof(*header) ||
+      memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      strncmp(header->root, root, PATH_SIZE) != 0)
+    return -1;
+
+  uint64_t needed = sizeof(*header) +
+                    (uint64_t)header->entries_len * sizeof(struct index_entry) +
+                    (uint64_t)header->trigrams_len *
+                        sizeof(struct index_trigram) +
+                    (uint64_t)header->postings_len * sizeof(uint32_t) +
+                    header->names_size;
+  if (needed != size || header->entries_len == 0 || header->names_size == 0 ||
+      map[size - 1] != '\0')
+    return -1;
+
+  view->header = header;
+  view->entries = (const struct index_entry *)(header + 1);
+  view->trigrams =
+      (const struct index_trigram *)(view->entries + header->entries_len);
+  view->postings = (const uint32_t *)(view->trigrams + header->trigrams_len);
+  view->names = (const char *)(view->postings + header->postings_len);
+
+  if (identity && index_checked)
+    for (unsigned int i = 0; i < INDEX_CHECKED_LEN; ++i)
+      if (__atomic_load_n(&index_checked[i], __ATOMIC_RELAXED) == identity)
+        return 0;
+
+  // Parents come before their children, and every range stays inside the
+  // range of its parent, which is all the walks over the entries rely on
+  for (uint32_t i = 0; i < header->entries_len; ++i) {
+    const struct index_entry *entry = &view->entries[i];
+    if (entry->name >= header->names_size || entry->end <= i ||
+        entry->end > header->entries_len)
+      return -1;
+    if (i == 0 ? entry->parent != INDEX_NONE
+               : entry->parent >= i ||
+                     !view->entries[entry->parent].is_dir ||
+                     view->entries[entry->parent].end < entry->end)
+      return -1;
+  }
+  for (uint32_t i = 0; i < header->trigrams_len; ++i)
+    if ((uint64_t)view->trigrams[i].start + view->trigrams[i].len >
+        header->postings_len)
+      return -1;
+
+  if (identity && index_checked) {
+    uint64_t added = __atomic_fetch_add(&index_checked[INDEX_CHECKED_LEN], 1,
+                                        __ATOMIC_RELAXED);
+    __atomic_store_n(&index_checked[added % INDEX_CHECKED_LEN], identity,
+                     __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+// Hash of a node, by its parent & name
+uint64_t index_node_hash(const struct index_node *parent, const char *name) {
+  uint64_t hash =
+      hash_bytes(14695981039346656037ULL, &parent, sizeof(parent));
+  return hash_bytes(hash, name, strlen(name));
+}
+
+// Returns the child of 'parent' called 'name', or NULL
+struct index_node *index_find(struct index_node *parent, const char *name) {
+  struct index_node *node =
+      index_buckets[index_node_hash(parent, name) & (index_buckets_len - 1)];
+  for (; node; node = node->hash_next)
+    if (node->parent == parent && strcmp(node->name, name) == 0)
+      return node;
+  return NULL;
+}
+
+// Doubles the buckets, so there are never more nodes than buckets
+int index_grow_buckets(void) {
+  uint32_t new_len = index_buckets_len ? index_buckets_len * 2 : 1024;
+  struct index_node **new_buckets = calloc(new_len, sizeof(*new_buckets));
+  if (!new_buckets)
+    return -1;
+
+  for (uint32_t i = 0; i < index_buckets_len; ++i) {
+    struct index_node *node = index_buckets[i], *next;
+    for (; node; node = next) {
+      next = node->hash_next;
+      uint32_t bucket =
+          index_node_hash(node->parent, node->name) & (new_len - 1);
+      node->hash_next = new_buckets[bucket];
+      new_buckets[bucket] = node;
+    }
+  }
+
+  free(index_buckets);
+  index_buckets = new_buckets;
+  index_buckets_len = new_len;
+  return 0;
+}
+
+// Adds a node called 'name' under 'parent', or the top of a tree if 'parent'
+// is NULL. Returns the node, or NULL if out of memory
+struct index_node *index_add(uint16_t tree, struct index_node *parent,
+                             const char *name, int is_dir) {
+  if (index_nodes_len >= index_buckets_len && index_grow_buckets() == -1)
+    return NULL;
+
+  struct index_node *node = calloc(1, sizeof(struct index_node));
+  if (!node || !(node->name = strdup(name))) {
+    free(node);
+    return NULL;
+  }
+  node->parent = parent;
+  node->wd = -1;
+  node->tree = tree;
+  node->is_dir = is_dir;
+  node->seen = 1;
+
+  if (parent) {
+    node->next = parent->children;
+    if (parent->children)
+      parent->children->prev = node;
+    parent->children = node;
+  }
+
+  uint32_t bucket =
+      index_node_hash(parent, name) & (index_buckets_len - 1);
+  node->hash_next = index_buckets[bucket];
+  index_buckets[bucket] = node;
+
+  index_nodes_len++;
+  index_trees[tree].nodes_len++;
+  index_trees[tree].dirty = 1;
+  return node;
+}
+
+// Removes a node along with everything under it
+void index_remove(struct index_node *node) {
+  while (node->children)
+    index_remove(node->children);
+
+  struct index_tree *tree = &index_trees[node->tree];
+  if (node->wd != -1) {
+    inotify_rm_watch(tree->inotify_fd, node->wd);
+    tree->watches[node->wd] = NULL;
+  }
+
+  if (node->prev)
+    node->prev->next = node->next;
+  else if (node->parent)
+    node->parent->children = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+
+  struct index_node **link =
+      &index_buckets[index_node_hash(node->parent, node->name) &
+                     (index_buckets_len - 1)];
+  while (*link != node)
+    link = &(*link)->hash_next;
+  *link = node->hash_next;
+
+  index_nodes_len--;
+  tree->nodes_len--;
+  tree->dirty = 1;
+  free(node->name);
+  free(node);
+}
+
+// Node after 'node' in depth-first order, without leaving 'top'
+struct index_node *index_next(struct index_node *node,
+                              const struct index_node *top) {
+  if (node->children)
+    return node->children;
+  while (node != top && !node->next)
+    node = node->parent;
+  return node == top ? NULL : node->next;
+}
+
+// Watches a directory for entries being added & removed
+int index_watch(struct index_node *dir, const char *path) {
+  struct index_tree *tree = &index_trees[dir->tree];
+  int wd = inotify_add_watch(tree->inotify_fd, path, INDEX_WATCH_EVENTS);
+  if (wd == -1)
+    return -1;
+
+  if (wd >= tree->watches_len) {
+    int new_len = tree->watches_len ? tree->watches_len * 2 : 1024;
+    while (new_len <= wd)
+      new_len *= 2;
+    struct index_node **grown =
+        realloc(tree->watches, new_len * sizeof(*grown));
+    if (!grown) {
+      inotify_rm_watch(tree->inotify_fd, wd);
+      return -1;
+    }
+    memset(grown + tree->watches_len, 0,
+           (new_len - tree->watches_len) * sizeof(*grown));
+    tree->watches = grown;
+    tree->watches_len = new_len;
+  }
+
+  dir->wd = wd;
+  tree->watches[wd] = dir;
+  return 0;
+}
+
+// Lists a directory at 'path', adding the entries the tree is missing and
+// removing the ones that are gone from the disk
+void index_list(struct index_node *dir, const char *path) {
+  DIR *dir_ptr = opendir(path);
+  if (!dir_ptr)
+    return;
+
+  for (struct index_node *child = dir->children; child; child = child->next)
+    child->seen = 0;
+
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir_ptr)) != NULL) {
+    char *file_name = dir_entry->d_name;
+    if (strcmp(file_name, "..") == 0 || strcmp(file_name, ".") == 0)
+      continue;
+
+    // Symlinks are not followed, a symlinked directory is indexed as a file
+    int is_dir = dir_entry->d_type == DT_DIR;
+    struct stat entry_stat;
+    if (dir_entry->d_type == DT_UNKNOWN &&
+        fstatat(dirfd(dir_ptr), file_name, &entry_stat,
+                AT_SYMLINK_NOFOLLOW) == 0)
+      is_dir = S_ISDIR(entry_stat.st_mode);
+
+    struct index_node *child = index_find(dir, file_name);
+    if (child && child->is_dir != is_dir) {
+      index_remove(child);
+      child = NULL;
+    }
+    if (!child && !(child = index_add(dir->tree, dir, file_name, is_dir)))
+      break;
+    child->seen = 1;
+  }
+  closedir(dir_ptr);
+
+  struct index_node *child = dir->children, *next;
+  for (; child; child = next) {
+    next = child->next;
+    if (!child->seen)
+      index_remove(child);
+  }
+  index_trees[dir->tree].dirty = 1;
+}
+
+int index_write(struct index_tree *tree);
+
+// Brings a directory up to date with the disk, along with every directory
+// under it. 'path' is the directory's path, of 'path_len' chars, and is used
+// as scratch space for the paths under it
+// A directory is only listed if its mtime changed since it was last listed,
+// so a tree read back from its index file costs a stat() per directory
+void index_sync(struct index_node *dir, char *path, size_t path_len) {
+  struct index_tree *tree = &index_trees[dir->tree];
+  if (!running)
+    return; // Shutting down, the rest is synced on the next start
+
+  // Watching before looking, so nothing can change unnoticed in between
+  if (dir->wd == -1 && index_watch(dir, path) == -1 && DEBUG == 1)
+    printf("Watching %s failed: %s\n", path, strerror(errno));
+
+  struct stat dir_stat;
+  if (lstat(path, &dir_stat) == -1 || !S_ISDIR(dir_stat.st_mode))
+    return;
+  if (dir_stat.st_mtim.tv_sec != dir->mtime.tv_sec ||
+      dir_stat.st_mtim.tv_nsec != dir->mtime.tv_nsec) {
+    dir->mtime = dir_stat.st_mtim;
+    index_list(dir, path);
+  }
+
+  // Big trees are searchable while they are still being walked
+  if (tree->dirty && monotonic_ns() >= tree->write_after &&
+      index_write(tree) == -1)
+    printf("Writing Index of %s failed: %s\n\n", tree->root, strerror(errno));
+
+  for (struct index_node *child = dir->children; child; child = child->next) {
+    if (!child->is_dir || path_len + 1 + strlen(child->name) >= PATH_SIZE)
+      continue;
+    snprintf(path + path_len, PATH_SIZE - path_len, "/%s", child->name);
+    index_sync(child, path, strlen(path));
+    path[path_len] = '\0';
+  }
+}
+
+// Builds the path of a directory node into 'path', returns its length, or -1
+// if it does not fit
+int index_node_path(const struct index_node *node, char *path) {
+  if (!node->parent)
+    return snprintf(path, PATH_SIZE, "%s", index_trees[node->tree].root);
+
+  int len = index_node_path(node->parent, path);
+  if (len == -1 || len + 1 + strlen(node->name) >= PATH_SIZE)
+    return -1;
+  return len + snprintf(path + len, PATH_SIZE - len, "/%s", node->name);
+}
+
+// Reads the events of a tree's inotify instance, and applies them to the tree
+void index_events(struct index_tree *tree) {
+  char buffer[INDEX_EVENT_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[PATH_SIZE];
+  ssize_t len;
+
+  while ((len = read(tree->inotify_fd, buffer, sizeof(buffer))) > 0) {
+    const struct inotify_event *event;
+    for (char *ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)ptr;
+
+      // Events were lost, checking every directory for changes
+      if (event->mask & IN_Q_OVERFLOW) {
+        print_debug("Index Events Overflowed, Syncing Whole Tree.\n");
+        index_sync(tree->top, strcpy(path, tree->root), strlen(tree->root));
+        continue;
+      }
+
+      if (event->wd < 0 || event->wd >= tree->watches_len ||
+          !tree->watches[event->wd])
+        continue;
+      struct index_node *dir = tree->watches[event->wd];
+
+      // Directory is gone, its parent removes it from the tree
+      if (event->mask & IN_IGNORED) {
+        tree->watches[event->wd] = NULL;
+        dir->wd = -1;
+        continue;
+      }
+      if (event->len == 0)
+        continue;
+
+      struct index_node *child = index_find(dir, event->name);
+      if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (child)
+          index_remove(child);
+      } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        int is_dir = (event->mask & IN_ISDIR) != 0;
+        if (child && child->is_dir != is_dir) {
+          index_remove(child);
+          child = NULL;
+        }
+        // New directories may already have entries, made before the watch
+        int path_len;
+        if (!child &&
+            (child = index_add(dir->tree, dir, event->name, is_dir)) &&
+            is_dir && (path_len = index_node_path(child, path)) != -1)
+          index_sync(child, path, path_len);
+      }
+    }
+  }
+}
+
+// Orders trigrams for the index file
+int compare_trigrams(const void *a, const void *b) {
+  uint32_t first = ((const struct index_trigram *)a)->trigram;
+  uint32_t second = ((const struct index_trigram *)b)->trigram;
+  return (first > second) - (first < second);
+}
+
+// Writes a tree to its index file, see struct index_header
+// The file is built in a temporary file that is renamed over the old one, so
+// connections searching the old one keep a consistent copy of it
+int index_write(struct index_tree *tree) {
+  uint64_t started = monotonic_ns();
+  uint32_t entries_len = 0, postings_len = 0, names_size = 0;
+  char lower[NAME_MAX + 1];
+  uint32_t trigrams[NAME_MAX];
+
+  // Counting the entries under every trigram, in a table at most half full
+  // 'len' 0 marks an empty slot
+  uint32_t table_size = 4096, table_used = 0;
+  struct index_trigram *table = calloc(table_size, sizeof(*table));
+  if (!table)
+    return -1;
+
+  for (struct index_node *node = tree->top; node;
+       node = index_next(node, tree->top)) {
+    node->id = entries_len++;
+    size_t len = index_lower(node->name, lower);
+    names_size += strlen(node->name) + 1;
+
+    unsigned int count = index_trigrams(lower, len, trigrams);
+    for (unsigned int i = 0; i < count; ++i) {
+      uint32_t slot = (trigrams[i] * 2654435761U) & (table_size - 1);
+      while (table[slot].len && table[slot].trigram != trigrams[i])
+        slot = (slot + 1) & (table_size - 1);
+      if (!table[slot].len) {
+        table[slot].trigram = trigrams[i];
+        table_used++;
+      }
+      table[slot].len++;
+      postings_len++;
+
+      if (table_used * 2 <= table_size)
+        continue;
+      // Rehashing into a table twice the size
+      struct index_trigram *grown = calloc(table_size * 2, sizeof(*grown));
+      if (!grown) {
+        free(table);
+        return -1;
+      }
+      for (uint32_t old = 0; old < table_size; ++old) {
+        if (!table[old].len)
+          continue;
+        uint32_t new_slot =
+            (table[old].trigram * 2654435761U) & (table_size * 2 - 1);
+        while (grown[new_slot].len)
+          new_slot = (new_slot + 1) & (table_size * 2 - 1);
+        grown[new_slot] = table[old];
+      }
+      free(table);
+      table = grown;
+      table_size *= 2;
+    }
+  }
+
+  // Packing the used slots, sorted so searches can bisect them
+  uint32_t trigrams_len = 0;
+  for (uint32_t slot = 0; slot < table_size; ++slot)
+    if (table[slot].len)
+      table[trigrams_len++] = table[slot];
+  qsort(table, trigrams_len, sizeof(*table), compare_trigrams);
+
+  size_t size = sizeof(struct index_header) +
+                (size_t)entries_len * sizeof(struct index_entry) +
+                (size_t)trigrams_len * sizeof(struct index_trigram) +
+                (size_t)postings_len * sizeof(uint32_t) + names_size;
+
+  char temp_path[PATH_SIZE + 16];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d", tree->file_path, getpid());
+  int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    free(table);
+    return -1;
+  }
+  char *map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    int saved_errno = errno;
+    close(fd);
+    unlink(temp_path);
+    free(table);
+    errno = saved_errno;
+    return -1;
+  }
+
+  struct index_header *header = (struct index_header *)map;
+  memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+  snprintf(header->root, PATH_SIZE, "%s", tree->root);
+  header->entries_len = entries_len;
+  header->trigrams_len = trigrams_len;
+  header->postings_len = postings_len;
+  header->names_size = names_size;
+
+  struct index_entry *entries = (struct index_entry *)(header + 1);
+  struct index_trigram *file_trigrams =
+      (struct index_trigram *)(entries + entries_len);
+  uint32_t *postings = (uint32_t *)(file_trigrams + trigrams_len);
+  char *names = (char *)(postings + postings_len);
+
+  // Every trigram starts where the one before it ends, 'len' is counted up
+  // again while filling in the postings
+  for (uint32_t i = 0, start = 0; i < trigrams_len; ++i) {
+    file_trigrams[i].trigram = table[i].trigram;
+    file_trigrams[i].start = start;
+    file_trigrams[i].len = 0;
+    start += table[i].len;
+  }
+  free(table);
+
+  uint32_t names_len = 0;
+  for (struct index_node *node = tree->top; node;
+       node = index_next(node, tree->top)) {
+    struct index_entry *entry = &entries[node->id];
+    entry->parent = node->parent ? node->parent->id : INDEX_NONE;
+    entry->end = node->id + 1; // Widened below, once the children are known
+    entry->name = names_len;
+    entry->is_dir = node->is_dir;
+    entry->mtime_sec = node->mtime.tv_sec;
+    entry->mtime_nsec = node->mtime.tv_nsec;
+    names_len += sprintf(names + names_len, "%s", node->name) + 1;
+
+    size_t len = index_lower(node->name, lower);
+    unsigned int count = index_trigrams(lower, len, trigrams);
+    for (unsigned int i = 0; i < count; ++i) {
+      struct index_trigram key = {.trigram = trigrams[i]};
+      struct index_trigram *found =
+          bsearch(&key, file_trigrams, trigrams_len, sizeof(key),
+                  compare_trigrams);
+      postings[found->start + found->len++] = node->id;
+    }
+  }
+
+  // Children come after their parents, so going backwards every range is
+  // complete by the time it is added to its parent's
+  for (uint32_t id = entries_len - 1; id > 0; --id) {
+    struct index_entry *parent = &entries[entries[id].parent];
+    if (parent->end < entries[id].end)
+      parent->end = entries[id].end;
+  }
+
+  munmap(map, size);
+  close(fd);
+  if (rename(temp_path, tree->file_path) == -1) {
+    int saved_errno = errno;
+    unlink(temp_path);
+    errno = saved_errno;
+    return -1;
+  }
+
+  // Writing big trees takes a while, so they are written less often
+  uint64_t took = monotonic_ns() - started;
+  uint64_t interval = (uint64_t)INDEX_WRITE_INTERVAL * 1000000000ULL;
+  tree->write_after =
+      monotonic_ns() + (took * 4 > interval ? took * 4 : interval);
+  tree->dirty = 0;
+
+  if (DEBUG == 1)
+    printf("Index of %s Written: %u Entries.\n", tree->root, entries_len);
+  return 0;
+}
+
+// Rebuilds a tree from its index file, if there is one for the same root
+// Directories keep the mtime they were last listed with, so index_sync() only
+// lists the ones changed since
+int index_load(struct index_tree *tree) {
+  int fd = open(tree->file_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  struct stat file_stat;
+  char *map = MAP_FAILED;
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  struct index_view view;
+  struct index_node **nodes = NULL;
+  int result = -1;
+  if (index_view(map, file_stat.st_size, tree->root, 0, &view) == 0 &&
+      (nodes = malloc(view.header->entries_len * sizeof(*nodes)))) {
+    nodes[0] = tree->top;
+    result = 0;
+    for (uint32_t id = 1; id < view.header->entries_len; ++id) {
+      const struct index_entry *entry = &view.entries[id];
+      if (!(nodes[id] = index_add(tree->top->tree, nodes[entry->parent],
+                                  view.names + entry->name, entry->is_dir))) {
+        result = -1;
+        break;
+      }
+    }
+    for (uint32_t id = 0; result == 0 && id < view.header->entries_len; ++id) {
+      nodes[id]->mtime.tv_sec = view.entries[id].mtime_sec;
+      nodes[id]->mtime.tv_nsec = view.entries[id].mtime_nsec;
+    }
+    // Starting over rather than trusting half a tree
+    while (result == -1 && tree->top->children)
+      index_remove(tree->top->children);
+  }
+
+  free(nodes);
+  munmap(map, file_stat.st_size);
+  tree->dirty = 0;
+  return result;
+}
+
+// Keeps the index of every host root up to date, in a process of its own
+// Every root is read back from its index file, synced with the disk, and
+// then kept in sync with inotify, writing the index file again at most every
+// INDEX_WRITE_INTERVAL seconds while it changes. Exits on SIGTERM
+void run_indexer(void) {
+  // Stopped by the server with a SIGTERM, which still runs shutdown_handler()
+  signal(SIGINT, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+  for (unsigned int i = 0; i < listeners_len; ++i)
+    close(listeners[i].fd);
+
+  if (!(index_trees = calloc(vhosts_len, sizeof(struct index_tree))))
+    err_n_die("Starting Indexer");
+
+  for (unsigned int i = 0; i < vhosts_len; ++i) {
+    unsigned int tree = 0;
+    while (tree < index_trees_len &&
+           strcmp(index_trees[tree].root, vhosts[i].root) != 0)
+      tree++;
+    if (tree < index_trees_len)
+      continue; // Root is already indexed for another host
+
+    struct index_tree *new_tree = &index_trees[index_trees_len];
+    snprintf(new_tree->root, PATH_SIZE, "%s", vhosts[i].root);
+    index_file_path(new_tree->root, new_tree->file_path);
+    if ((new_tree->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) ==
+        -1)
+      err_n_die("Starting Indexer");
+    if (!(new_tree->top = index_add(index_trees_len, NULL, "", 1)))
+      err_n_die("Starting Indexer");
+    index_trees_len++;
+
+    if (index_load(new_tree) == 0 && DEBUG == 1)
+      printf("Index of %s Loaded: %u Entries.\n", new_tree->root,
+             new_tree->nodes_len);
+  }
+
+  char path[PATH_SIZE];
+  for (unsigned int i = 0; i < index_trees_len; ++i) {
+    struct index_tree *tree = &index_trees[i];
+    index_sync(tree->top, strcpy(path, tree->root), strlen(tree->root));
+    tree->write_after = 0; // Written right away, once fully synced
+  }
+
+  struct pollfd index_polls[index_trees_len];
+  for (unsigned int i = 0; i < index_trees_len; ++i) {
+    index_polls[i].fd = index_trees[i].inotify_fd;
+    index_polls[i].events = POLLIN;
+  }
+
+  while (running) {
+    // Waiting for the next write if anything changed, or for events
+    int timeout = -1;
+    uint64_t now = monotonic_ns();
+    for (unsigned int i = 0; i < index_trees_len; ++i) {
+      struct index_tree *tree = &index_trees[i];
+      if (!tree->dirty)
+        continue;
+      if (tree->write_after <= now && index_write(tree) == -1) {
+        printf("Writing Index of %s failed: %s\n\n", tree->root,
+               strerror(errno));
+        tree->dirty = 0; // Tried again on the next change
+      }
+      if (tree->dirty) {
+        int wait_ms = (tree->write_after - now + 999999) / 1000000;
+        if (timeout == -1 || wait_ms < timeout)
+          timeout = wait_ms;
+      }
+    }
+    fflush(stdout);
+
+    if (poll(index_polls, index_trees_len, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      err_n_die("Polling Index Events");
+    }
+    for (unsigned int i = 0; i < index_trees_len; ++i)
+      if (index_polls[i].revents & POLLIN)
+        index_events(&index_trees[i]);
+  }
+
+  // Saving what changed since the last write, so it is not synced again
+  for (unsigned int i = 0; i < index_trees_len; ++i)
+    if (index_trees[i].dirty && index_write(&index_trees[i]) == -1)
+      printf("Writing Index of %s failed: %s\n\n", index_trees[i].root,
+             strerror(errno));
+  print_debug("Indexer Stopped.\n");
+  exit(0);
+}
+
+// Forks a helper process of the server, running 'run' which never returns
+// Helpers are not connections, sigchild_handler() tells them apart by 'pid'
+void start_helper(void (*run)(void), volatile sig_atomic_t *pid,
+                  const char *name) {
+  sigset_t sigchld_set;
+  sigemptyset(&sigchld_set);
+  sigaddset(&sigchld_set, SIGCHLD);
+
+  fflush(stdout);
+  sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+  pid_t new_pid = fork();
+  if (new_pid == 0) {
+    sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+    sigprocmask(SIG_UNBLOCK, &control_signals, NULL);
+    run();
+  }
+  if (new_pid == -1)
+    printf("Starting %s failed: %s\n\n", name, strerror(errno));
+  else
+    *pid = new_pid;
+  sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+
+  if (DEBUG == 1 && new_pid != -1)
+    printf("%s Started.\n", name);
+}
+
+// Stops a helper process, waiting for it to exit
+void stop_helper(volatile sig_atomic_t *pid) {
+  sigset_t sigchld_set;
+  sigemptyset(&sigchld_set);
+  sigaddset(&sigchld_set, SIGCHLD);
+
+  // SIGCHLD is blocked, so the helper is reaped here and not by
+  // sigchild_handler()
+  sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+  pid_t helper_pid = *pid;
+  if (helper_pid && kill(helper_pid, SIGTERM) == 0)
+    while (waitpid(helper_pid, NULL, 0) == -1 && errno == EINTR)
+      ;
+  *pid = 0;
+  sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+}
+
+// Starts the indexer process for the current hosts, if indexing is on
+void start_indexer(void) {
+  if (index_dir)
+    start_helper(run_indexer, &indexer_pid, "Indexer");
+}
+
+// Stops the indexer process, waiting for it to save its indexes
+void stop_indexer(void) { stop_helper(&indexer_pid); }
+
+// Writes 'str' to 'out' as a JSON string, with the quotes
+void json_write_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str; ++str) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+// Fills the response with a JSON body of 'body_len' bytes, sent with the
+// status in 'response_status'
+int json_response(struct client_info *client, const char *body,
+                  size_t body_len) {
+  char *header;
+  unsigned int header_size = 0;
+  if (generate_header(&header, client->response_status, "application/json",
+                      body_len, NULL, &header_size) == -1)
+    return -1;
+
+  client->response = malloc(header_size + body_len + 1);
+  if (!client->response) {
+    free(header);
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(client->response, header, header_size);
+  memcpy(client->response + header_size, body, body_len);
+  client->response[header_size + body_len] = '\0';
+  client->response_len = header_size + body_len;
+
+  free(header);
+  return 0;
+}
+
+// Match found by search_index(), lower 'rank' is better
+struct search_match {
+  uint32_t id;
+  uint16_t rank;
+  uint16_t name_len;
+};
+
+// Orders matches by rank, then by the length of the name, then by path
+int compare_matches(const void *a, const void *b) {
+  const struct search_match *first = a, *second = b;
+  if (first->rank != second->rank)
+    return first->rank - second->rank;
+  if (first->name_len != second->name_len)
+    return first->name_len - second->name_len;
+  return (first->id > second->id) - (first->id < second->id);
+}
+
+// Keeps the best 'keep' matches seen so far in 'heap', with the worst of them
+// on top, so a page of results costs O(matches log keep) instead of a sort of
+// every match. 'heap' has room for 'keep' matches
+void search_keep(struct search_match *heap, size_t *heap_len, size_t keep,
+                 struct search_match match) {
+  size_t i;
+  if (*heap_len < keep) {
+    // Not full yet, sifting the new match up
+    i = (*heap_len)++;
+    while (i > 0 && compare_matches(&heap[(i - 1) / 2], &match) < 0) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = match;
+    return;
+  }
+
+  if (compare_matches(&match, &heap[0]) >= 0)
+    return; // Worse than every kept match
+
+  // Replacing the worst kept match, and sifting the new one down
+  i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= keep)
+      break;
+    if (child + 1 < keep &&
+        compare_matches(&heap[child + 1], &heap[child]) > 0)
+      child++;
+    if (compare_matches(&heap[child], &match) <= 0)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = match;
+}
+
+// Fills the response with the entries under the requested directory whose
+// names contain 'query', ignoring case, as JSON
+// Names equal to the query rank first, then the ones starting with it, then
+// the ones with it at the start of a word. Results are split in pages of
+// SEARCH_PAGE_SIZE, picked with '?page=', counting from 1
+// Only the matches up to the end of the page are kept. Queries too short for
+// a trigram look at the first SEARCH_SCAN_MAX entries of the directory only,
+// and say so with '"partial":true'
+int search_index(struct client_info *client, const char *query) {
+  char page_param[16];
+  unsigned long page = 1;
+  if (get_query_param(client, "page", page_param, sizeof(page_param)))
+    page = strtoul(page_param, NULL, 10);
+  if (page == 0)
+    page = 1;
+  if (page > INDEX_NONE / SEARCH_PAGE_SIZE)
+    page = INDEX_NONE / SEARCH_PAGE_SIZE; // No index has more entries
+
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&body, &body_len);
+  if (!out)
+    return -1;
+
+  const char *root = client->vhost->root;
+  char file_path[PATH_SIZE];
+  struct stat file_stat;
+  char *map = MAP_FAILED;
+  struct index_view view;
+
+  if (index_dir) {
+    index_file_path(root, file_path);
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+        map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+    }
+    if (map != MAP_FAILED &&
+        index_view(map, file_stat.st_size, root, index_identity(&file_stat),
+                   &view) == -1) {
+      munmap(map, file_stat.st_size);
+      map = MAP_FAILED;
+    }
+  }
+
+  if (!index_dir) {
+    snprintf(client->response_status, STATUS_SIZE, "501 Not Implemented");
+    fputs("{\"error\":\"Indexing is off\"}", out);
+  } else if (map == MAP_FAILED) {
+    snprintf(client->response_status, STATUS_SIZE, "503 Service Unavailable");
+    fputs("{\"error\":\"Index is not ready\"}", out);
+  } else {
+    // Finding the requested directory, children of an entry are the entries
+    // in its range, each one followed by its own range
+    uint32_t scope = 0;
+    const char *rest = client->request_path + strlen(root);
+    while (scope != INDEX_NONE && *rest) {
+      while (*rest == '/')
+        rest++;
+      size_t part_len = strcspn(rest, "/");
+      if (part_len == 0)
+        break;
+      uint32_t child = scope + 1;
+      while (child < view.entries[scope].end &&
+             !(strncmp(view.names + view.entries[child].name, rest,
+                       part_len) == 0 &&
+               view.names[view.entries[child].name + part_len] == '\0'))
+        child = view.entries[child].end;
+      scope = child < view.entries[scope].end ? child : INDEX_NONE;
+      rest += part_len;
+    }
+
+    char lower_query[NAME_MAX + 1];
+    size_t query_len = index_lower(query, lower_query);
+    if (strlen(query) > NAME_MAX)
+      scope = INDEX_NONE; // No name is that long
+
+    // Candidates are the entries of the query's rarest trigram, or every
+    // entry in the directory for queries too short to have one
+    const uint32_t *candidates = NULL;
+    uint32_t candidates_len = 0, first = 0, end = 0;
+    if (scope != INDEX_NONE && query_len > 0) {
+      first = scope + 1;
+      end = view.entries[scope].end;
+      uint32_t trigrams[NAME_MAX];
+      unsigned int count = index_trigrams(lower_query, query_len, trigrams);
+      for (unsigned int i = 0; i < count; ++i) {
+        struct index_trigram key = {.trigram = trigrams[i]};
+        const struct index_trigram *found =
+            bsearch(&key, view.trigrams, view.header->trigrams_len,
+                    sizeof(key), compare_trigrams);
+        if (!found) {
+          end = first; // Nothing has this trigram
+          break;
+        }
+        if (!candidates || found->len < candidates_len) {
+          candidates = view.postings + found->start;
+          candidates_len = found->len;
+        }
+      }
+    }
+
+    // Postings are sorted, so the ones inside the directory are found by
+    // bisecting for its range
+    uint32_t next = 0;
+    if (candidates) {
+      uint32_t low = 0, high = candidates_len;
+      while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (candidates[mid] < first)
+          low = mid + 1;
+        else
+          high = mid;
+      }
+      next = low;
+    }
+
+    int partial = 0;
+    if (!candidates && end - first > SEARCH_SCAN_MAX) {
+      end = first + SEARCH_SCAN_MAX;
+      partial = 1;
+    }
+
+    size_t keep = page * SEARCH_PAGE_SIZE;
+    struct search_match *matches = NULL;
+    size_t matches_len = 0, matches_size = 0, total = 0;
+    char lower_name[NAME_MAX + 1];
+    for (uint32_t id = first; id < end;) {
+      if (candidates) {
+        if (next == candidates_len || candidates[next] >= end)
+          break;
+        id = candidates[next++];
+      }
+      const char *name = view.names + view.entries[id].name;
+      size_t name_len = index_lower(name, lower_name);
+      const char *found = strstr(lower_name, lower_query);
+
+      if (found) {
+        uint16_t rank = 3;
+        if (found == lower_name)
+          rank = name_len == query_len ? 0 : 1;
+        else if (!isalnum((unsigned char)found[-1]))
+          rank = 2;
+
+        total++;
+        if (matches_len == matches_size && matches_size < keep) {
+          size_t new_size = matches_size ? matches_size * 2 : 256;
+          if (new_size > keep)
+            new_size = keep;
+          struct search_match *grown =
+              realloc(matches, new_size * sizeof(*grown));
+          if (!grown) {
+            free(matches);
+            fclose(out);
+            free(body);
+            munmap(map, file_stat.st_size);
+            errno = ENOMEM;
+            return -1;
+          }
+          matches = grown;
+          matches_size = new_size;
+        }
+        search_keep(matches, &matches_len, keep,
+                    (struct search_match){id, rank, (uint16_t)name_len});
+      }
+
+      if (!candidates)
+        id++;
+    }
+    qsort(matches, matches_len, sizeof(*matches), compare_matches);
+
+    size_t pages = (total + SEARCH_PAGE_SIZE - 1) / SEARCH_PAGE_SIZE;
+    fputs("{\"query\":", out);
+    json_write_string(out, query);
+    fprintf(out,
+            ",\"page\":%lu,\"pages\":%zu,\"total\":%zu,\"partial\":%s,"
+            "\"results\":[",
+            page, pages, total, partial ? "true" : "false");
+
+    // Paths are relative to the requested directory, like in its listing,
+    // and directories end with a '/'
+    size_t from = (page - 1) * SEARCH_PAGE_SIZE;
+    for (size_t i = from; page <= pages && i < matches_len &&
+                          i < from + SEARCH_PAGE_SIZE;
+         ++i) {
+      char path[PATH_SIZE];
+      size_t start = PATH_SIZE - 1;
+      path[start] = '\0';
+      if (view.entries[matches[i].id].is_dir)
+        path[--start] = '/';
+      for (uint32_t id = matches[i].id; id != scope;
+           id = view.entries[id].parent) {
+        const char *name = view.names + view.entries[id].name;
+        size_t name_len = strlen(name);
+        if (start < name_len + 1)
+          break;
+        if (start < PATH_SIZE - 1 && path[start] != '/')
+          path[--start] = '/';
+        start -= name_len;
+        memcpy(path + start, name, name_len);
+      }
+      if (i > from)
+        fputc(',', out);
+      json_write_string(out, path + start);
+    }
+    fputs("]}", out);
+
+    free(matches);
+    munmap(map, file_stat.st_size);
+  }
+
+  if (fclose(out) == EOF) {
+    free(body);
+    return -1;
+  }
+
+  int result = json_response(client, body, body_len);
+  free(body);
+  print_debug("Search Results Generated.\n");
+  return result;
+}
+
+// Fills the response with a JSON error, sent with 'status'
+int json_error(struct client_info *client, const char *status,
+               const char *message) {
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&body, &body_len);
+  if (!out)
+    return -1;
+  fputs("{\"error\":", out);
+  json_write_string(out, message);
+  fputs("}", out);
+  if (fclose(out) == EOF) {
+    free(body);
+    return -1;
+  }
+
+  snprintf(client->response_status, STATUS_SIZE, "%s", status);
+  int result = json_response(client, body, body_len);
+  free(body);
+  return result;
+}
+
+// Status of a failed upload, by its errno
+const char *upload_status(int error) {
+  switch (error) {
+  case ENOENT:
+    return "404 Not Found";
+  case EPERM:
+  case EACCES:
+    return "403 Forbidden";
+  case EISDIR:
+  case ENOTDIR:
+    return "409 Conflict";
+  case EPROTO:
+  case ECONNRESET:
+  case EINVAL:
+    return "400 Bad Request";
+  case ETIMEDOUT:
+    return "408 Request Timeout";
+  case EFBIG:
+    return "413 Content Too Large";
+  case ENAMETOOLONG:
+    return "414 URI Too Long";
+  case ENOSPC:
+  case EDQUOT:
+    return "507 Insufficient Storage";
+  default:
+    return "500 Internal Server Error";
+  }
+}
+
+// Compares a token sent by a client with the expected one, taking the same
+// time wherever they differ, so the token cannot be guessed char by char
+int tokens_equal(const char *given, const char *expected) {
+  size_t given_len = strlen(given), expected_len = strlen(expected);
+  unsigned char diff = given_len != expected_len;
+  for (size_t i = 0; i < expected_len; ++i)
+    diff |= (unsigned char)given[given_len ? i % given_len : 0] ^
+            (unsigned char)expected[i];
+  return diff == 0;
+}
+
+// Writes all of 'data' to 'fd'
+int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written == -1) {
+      if (errno == EINTR && running)
+        continue;
+      return -1;
+    }
+    data += written;
+    len -= written;
+  }
+  return 0;
+}
+
+// Waits for more of the body to arrive, for at most SEND_TIMEOUT seconds,
+// and never past the deadline of the whole body, so a client sending a byte
+// now and then cannot hold on to the connection either
+// Returns -1 with errno set to ETIMEDOUT if either runs out
+int body_wait(struct request_body *body) {
+  for (;;) {
+    uint64_t now = monotonic_ns();
+    if (now >= body->deadline) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    uint64_t wait_ns = body->deadline - now;
+    if (SEND_TIMEOUT && wait_ns > (uint64_t)SEND_TIMEOUT * 1000000000ULL)
+      wait_ns = (uint64_t)SEND_TIMEOUT * 1000000000ULL;
+    int wait_ms = wait_ns / 1000000 < INT_MAX ? (wait_ns + 999999) / 1000000
+                                              : INT_MAX;
+
+    struct pollfd client_poll = {.fd = body->client->client_fd,
+                                 .events = POLLIN};
+    int ready = poll(&client_poll, 1, wait_ms);
+    if (ready == -1) {
+      if (errno == EINTR && running)
+        continue;
+      return -1;
+    }
+    if (ready == 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    return 0;
+  }
+}
+
+// Reads up to 'len' bytes of the raw body, the bytes read along with the
+// headers first, then from the socket
+// Returns -1 with errno set to ECONNRESET if the client closes the connection
+// early, and to ETIMEDOUT if it runs out of time, see body_wait()
+ssize_t body_raw(struct request_body *body, char *buffer, size_t len) {
+  if (body->buffered_len) {
+    size_t copy = len < body->buffered_len ? len : body->buffered_len;
+    memcpy(buffer, body->buffered, copy);
+    body->buffered += copy;
+    body->buffered_len -= copy;
+    return copy;
+  }
+
+  if (body_wait(body) == -1)
+    return -1;
+  ssize_t bytes_read;
+  while ((bytes_read = read(body->client->client_fd, buffer, len)) == -1 &&
+         errno == EINTR && running)
+    ;
+  if (bytes_read == 0) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  return bytes_read;
+}
+
+// Reads a line of chunk framing, without the CRLF. Read a byte at a time, so
+// nothing after the line is taken from the socket
+int body_line(struct request_body *body, char *line, size_t size) {
+  size_t len = 0;
+  for (;;) {
+    char c;
+    if (body_raw(body, &c, 1) == -1)
+      return -1;
+    if (c == '\n')
+      break;
+    if (len == size - 1) {
+      errno = EPROTO;
+      return -1;
+    }
+    line[len++] = c;
+  }
+  if (len > 0 && line[len - 1] == '\r')
+    len--;
+  line[len] = '\0';
+  return 0;
+}
+
+// Returns how many bytes of the body can be read right now, the rest of the
+// body or of the current chunk, reading the chunk framing when needed
+// Returns 0 at the end of the body, and -1 on errors, with errno set to
+// EPROTO if the chunk framing is broken
+int64_t body_next(struct request_body *body) {
+  if (body->left || body->done)
+    return body->left;
+  if (!body->chunked) {
+    body->done = 1;
+    return 0;
+  }
+
+  // Data of every chunk is followed by a CRLF, then comes the next size
+  char line[256];
+  if (body->started) {
+    if (body_line(body, line, sizeof(line)) == -1)
+      return -1;
+    if (line[0] != '\0') {
+      errno = EPROTO;
+      return -1;
+    }
+  }
+  if (body_line(body, line, sizeof(line)) == -1)
+    return -1;
+
+  char *size_end;
+  errno = 0;
+  unsigned long long size = strtoull(line, &size_end, 16);
+  if (size_end == line || errno == ERANGE ||
+      (*size_end && *size_end != ';' && !isspace((unsigned char)*size_end))) {
+    errno = EPROTO;
+    return -1;
+  }
+  body->started = 1;
+
+  // Last chunk, skipping the trailer fields up to the blank line
+  if (size == 0) {
+    do
+      if (body_line(body, line, sizeof(line)) == -1)
+        return -1;
+    while (line[0] != '\0');
+    body->done = 1;
+    return 0;
+  }
+
+  body->left = size;
+  return size;
+}
+
+// Reads up to 'len' bytes of the body into 'buffer'
+// Returns the number of bytes read, 0 at the end of the body, -1 on errors
+ssize_t body_read(struct request_body *body, char *buffer, size_t len) {
+  int64_t available = body_next(body);
+  if (available <= 0)
+    return available;
+
+  if ((uint64_t)available < len)
+    len = available;
+  ssize_t bytes_read = body_raw(body, buffer, len);
+  if (bytes_read > 0)
+    body->left -= bytes_read;
+  return bytes_read;
+}
+
+// Moves the whole body into 'fd', adding the number of bytes to 'size'
+// Bytes read along with the headers are written, the rest is spliced from
+// the socket to the file through a pipe, so it never passes through here
+int body_to_file(struct request_body *body, int fd, uint64_t *size) {
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+    return -1;
+
+  int result = 0;
+  int64_t available;
+  while (result == 0 && (available = body_next(body)) > 0) {
+    size_t want =
+        available < UPLOAD_BUFFER_SIZE ? (size_t)available : UPLOAD_BUFFER_SIZE;
+    ssize_t moved;
+
+    if (body->buffered_len) {
+      moved = want < body->buffered_len ? want : body->buffered_len;
+      if (write_all(fd, body->buffered, moved) == -1)
+        result = -1;
+      body->buffered += moved;
+      body->buffered_len -= moved;
+    } else {
+      if (body_wait(body) == -1) {
+        result = -1;
+        break;
+      }
+      moved = splice(body->client->client_fd, NULL, pipe_fds[1], NULL, want,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved == -1 && errno == EINTR && running)
+        continue;
+      if (moved <= 0) {
+        if (moved == 0)
+          errno = ECONNRESET;
+        result = -1;
+        break;
+      }
+
+      for (ssize_t out = 0; out < moved;) {
+        ssize_t spliced =
+            splice(pipe_fds[0], NULL, fd, NULL, moved - out, SPLICE_F_MOVE);
+        if (spliced == -1 && errno == EINTR && running)
+          continue;
+        if (spliced <= 0) {
+          result = -1;
+          break;
+        }
+        out += spliced;
+      }
+    }
+
+    body->left -= moved;
+    *size += moved;
+  }
+  if (result == 0 && available == -1)
+    result = -1;
+
+  int saved_errno = errno;
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  errno = saved_errno;
+  return result;
+}
+
+// Opens the directory at 'path' of the request's host, 'path' being relative
+// to the host root, and makes sure it is inside the root
+// Returns the directory's fd, or -1 with errno set to EPERM if it is outside
+int upload_open_dir(struct client_info *client, const char *path) {
+  const char *root = client->vhost->root;
+  char full_path[PATH_SIZE], real_path[PATH_SIZE];
+  if (snprintf(full_path, PATH_SIZE, "%s/%s", root, path) >= PATH_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (!realpath(full_path, real_path))
+    return -1;
+
+  if (!path_in_root(real_path, root)) {
+    errno = EPERM;
+    return -1;
+  }
+
+  // A directory of the path may have been swapped for a symlink since it was
+  // resolved, so the directory that got opened is checked again. Files are
+  // only created relative to it from here on
+  int dir_fd = open(real_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1)
+    return -1;
+  if (!fd_in_root(dir_fd, root)) {
+    close(dir_fd);
+    errno = EPERM;
+    return -1;
+  }
+
+  return dir_fd;
+}
+
+// Names a temporary file for an upload into 'temp_name', of
+// UPLOAD_TEMP_NAME_SIZE
+void upload_temp_name(char *temp_name) {
+  static unsigned int uploads = 0;
+  snprintf(temp_name, UPLOAD_TEMP_NAME_SIZE, ".upload.%d.%u", getpid(),
+           uploads++);
+}
+
+// Creates the temporary file an upload is written to, in the directory it is
+// uploaded to, so it can be put in place once complete
+// Where O_TMPFILE is supported the file has no name until then, so it is not
+// listed, and is gone by itself if the upload fails. Elsewhere it is named
+// into 'temp_name', which is left empty for unnamed files
+int upload_open_temp(int dir_fd, char *temp_name) {
+  temp_name[0] = '\0';
+  int fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    return fd;
+
+  upload_temp_name(temp_name);
+  return openat(dir_fd, temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                0644);
+}
+
+// Puts a finished upload in place as 'name' once it is on disk, so readers
+// see either the old file or the whole new one. Removes it instead if
+// 'failed'
+int upload_finish(int dir_fd, int fd, char *temp_name, const char *name,
+                  int failed) {
+  if (!failed && fsync(fd) == -1)
+    failed = 1;
+
+  // An unnamed file is linked in right away if nothing has the name yet,
+  // otherwise under a temporary name, to be renamed over the old file
+  if (!failed && temp_name[0] == '\0') {
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, fd_path, dir_fd, name, AT_SYMLINK_FOLLOW) == 0)
+      return close(fd);
+    if (errno != EEXIST)
+      failed = 1;
+    else {
+      upload_temp_name(temp_name);
+      if (linkat(AT_FDCWD, fd_path, dir_fd, temp_name, AT_SYMLINK_FOLLOW) ==
+          -1) {
+        temp_name[0] = '\0';
+        failed = 1;
+      }
+    }
+  }
+
+  if (close(fd) == -1)
+    failed = 1;
+  if (!failed && renameat(dir_fd, temp_name, dir_fd, name) == 0)
+    return 0;
+
+  int saved_errno = errno;
+  if (temp_name[0] != '\0')
+    unlinkat(dir_fd, temp_name, 0);
+  errno = saved_errno;
+  return -1;
+}
+
+// Checks that a file name from a request names a file in the directory
+int upload_name_valid(const char *name) {
+  return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+         strlen(name) <= NAME_MAX;
+}
+
+// Tells a client waiting with 'Expect: 100-continue' to send the body, once
+// the upload is known to be accepted. Clients that started sending anyway
+// are not told
+void send_continue(struct client_info *client, struct request_body *body) {
+  char expect[32];
+  if (body->buffered_len == 0 &&
+      get_header(client, "Expect", expect, sizeof(expect)) &&
+      strcasecmp(expect, "100-continue") == 0) {
+    struct iovec continue_iov = {(char *)"HTTP/1.1 100 Continue\r\n\r\n", 25};
+    send_response(client, &continue_iov, 1);
+  }
+}
+
+// Writes the body of a PUT request to the file at the request path,
+// replacing the file if it exists. The file is preallocated when the length
+// of the body is known
+int upload_file(struct client_info *client, struct request_body *body,
+                int64_t length) {
+  // Splitting the path into the directory & the file name
+  char dir_path[PATH_SIZE], name[PATH_SIZE];
+  snprintf(dir_path, PATH_SIZE, "%s", client->request_path);
+  char *slash = strrchr(dir_path, '/');
+  snprintf(name, PATH_SIZE, "%s", slash ? slash + 1 : dir_path);
+  if (slash)
+    *slash = '\0';
+  else
+    snprintf(dir_path, PATH_SIZE, ".");
+
+  if (!upload_name_valid(name))
+    return json_error(client, "409 Conflict", "Path does not name a file");
+
+  int dir_fd = upload_open_dir(client, dir_path);
+  if (dir_fd == -1)
+    return json_error(client, upload_status(errno), strerror(errno));
+
+  struct stat target_stat;
+  int exists =
+      fstatat(dir_fd, name, &target_stat, AT_SYMLINK_NOFOLLOW) == 0;
+  if (exists && S_ISDIR(target_stat.st_mode)) {
+    close(dir_fd);
+    return json_error(client, "409 Conflict", strerror(EISDIR));
+  }
+
+  send_continue(client, body);
+
+  char temp_name[UPLOAD_TEMP_NAME_SIZE];
+  uint64_t size = 0;
+  int fd = upload_open_temp(dir_fd, temp_name);
+  int failed = fd == -1;
+
+  // Reserving the space up front, so a full disk fails the upload right away
+  // and the file is not fragmented. Not every file system supports it
+  if (!failed && length > 0 && fallocate(fd, 0, 0, length) == -1 &&
+      errno != EOPNOTSUPP && errno != ENOSYS)
+    failed = 1;
+  if (!failed && body_to_file(body, fd, &size) == -1)
+    failed = 1;
+  if (fd != -1 && upload_finish(dir_fd, fd, temp_name, name, failed) == -1)
+    failed = 1;
+  int saved_errno = errno;
+  close(dir_fd);
+
+  if (failed)
+    return json_error(client, upload_status(saved_errno),
+                      strerror(saved_errno));
+
+  if (DEBUG == 1)
+    printf("Uploaded %llu Bytes to: %s\n", (unsigned long long)size,
+           client->request_path);
+
+  char *response_body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&response_body, &body_len);
+  if (!out)
+    return -1;
+  fputs("{\"path\":", out);
+  json_write_string(out, client->request_path);
+  fprintf(out, ",\"size\":%llu}", (unsigned long long)size);
+  fclose(out);
+
+  snprintf(client->response_status, STATUS_SIZE,
+           exists ? "200 OK" : "201 Created");
+  int result = json_response(client, response_body, body_len);
+  free(response_body);
+  return result;
+}
+
+// Copies the file name of a form part from its headers into 'name', dropping
+// any directories in it. Returns 1 if the part is a file, 0 if not or if no
+// file was picked for it
+int form_file_name(const char *headers, char *name) {
+  const char *start = strcasestr(headers, "filename=\"");
+  if (!start)
+    return 0;
+  start += strlen("filename=\"");
+  const char *end = strchr(start, '"');
+  // Browsers send an empty name for a file input left empty
+  if (!end || end == start)
+    return 0;
+
+  // Browsers send only the name, other clients may send a whole path
+  for (const char *c = start; c < end; ++c)
+    if (*c == '/' || *c == '\\')
+      start = c + 1;
+
+  snprintf(name, PATH_SIZE, "%.*s", (int)(end - start), start);
+  return 1;
+}
+
+// Writes every file of a multipart/form-data POST request to the requested
+// directory. Other form fields are skipped
+// The body is scanned for the boundary in a buffer of UPLOAD_BUFFER_SIZE, and
+// every part is written out as it is scanned
+int upload_form(struct client_info *client, struct request_body *body) {
+  char content_type[256], boundary[128];
+  if (!get_header(client, "Content-Type", content_type,
+                  sizeof(content_type)) ||
+      strncasecmp(content_type, "multipart/form-data", 19) != 0)
+    return json_error(client, "415 Unsupported Media Type",
+                      "Uploads have to be multipart/form-data");
+
+  const char *boundary_start = strcasestr(content_type, "boundary=");
+  if (boundary_start) {
+    boundary_start += strlen("boundary=");
+    if (*boundary_start == '"')
+      boundary_start++;
+    snprintf(boundary, sizeof(boundary), "%.*s",
+             (int)strcspn(boundary_start, "\";"), boundary_start);
+  }
+  if (!boundary_start || boundary[0] == '\0' || strlen(boundary) > 70)
+    return json_error(client, "400 Bad Request", "Missing form boundary");
+
+  int dir_fd = upload_open_dir(client, client->request_path);
+  if (dir_fd == -1)
+    return json_error(client, upload_status(errno), strerror(errno));
+
+  send_continue(client, body);
+
+  // Every boundary is preceded by a CRLF, which is added before the first
+  // one, so all of them can be matched the same way
+  char delimiter[80];
+  size_t delimiter_len =
+      snprintf(delimiter, sizeof(delimiter), "\r\n--%s", boundary);
+  char *buffer = malloc(UPLOAD_BUFFER_SIZE);
+  char *files = NULL;
+  size_t files_len = 0;
+  FILE *files_out = open_memstream(&files, &files_len);
+  if (!buffer || !files_out) {
+    free(buffer);
+    if (files_out)
+      fclose(files_out);
+    free(files);
+    close(dir_fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(buffer, "\r\n", 2);
+  size_t len = 2;
+
+  // Before the first boundary, in the headers of a part, in the data of a
+  // part, after the last boundary
+  enum { FORM_PREAMBLE, FORM_HEADERS, FORM_DATA, FORM_END } state =
+      FORM_PREAMBLE;
+  int file_fd = -1, error = 0;
+  char name[PATH_SIZE], temp_name[UPLOAD_TEMP_NAME_SIZE];
+  uint64_t file_size = 0;
+  unsigned int files_count = 0;
+
+  while (state != FORM_END && !error) {
+    size_t consumed = 0;
+
+    if (state == FORM_HEADERS) {
+      char *headers_end = memmem(buffer, len, "\r\n\r\n", 4);
+      if (headers_end) {
+        *headers_end = '\0';
+        if (form_file_name(buffer, name)) {
+          if (!upload_name_valid(name))
+            error = EINVAL;
+          else if ((file_fd = upload_open_temp(dir_fd, temp_name)) == -1)
+            error = errno;
+          file_size = 0;
+        }
+        state = FORM_DATA;
+        consumed = headers_end + 4 - buffer;
+      } else if (len == UPLOAD_BUFFER_SIZE)
+        error = EPROTO; // Headers of a part do not fit
+    } else {
+      // Everything before the boundary belongs to the current part, without
+      // a boundary everything but what could be the start of one does
+      char *found = memmem(buffer, len, delimiter, delimiter_len);
+      size_t data_len = found                   ? (size_t)(found - buffer)
+                        : len >= delimiter_len ? len - (delimiter_len - 1)
+                                               : 0;
+      if (file_fd != -1 && data_len) {
+        if (write_all(file_fd, buffer, data_len) == -1)
+          error = errno;
+        file_size += data_len;
+      }
+      consumed = data_len;
+
+      // Boundary is followed by '--' after the last part, by a CRLF
+      // otherwise
+      size_t after = data_len + delimiter_len;
+      if (found && !error && len >= after + 2) {
+        if (file_fd != -1) {
+          if (upload_finish(dir_fd, file_fd, temp_name, name, 0) == -1)
+            error = errno;
+          else {
+            fputs(files_count++ ? "," : "", files_out);
+            char path[PATH_SIZE * 2];
+            snprintf(path, sizeof(path), "%s/%s",
+                     strcmp(client->request_path, "./") == 0
+                         ? ""
+                         : client->request_path,
+                     name);
+            fputs("{\"path\":", files_out);
+            json_write_string(files_out, path);
+            fprintf(files_out, ",\"size\":%llu}",
+                    (unsigned long long)file_size);
+            if (DEBUG == 1)
+              printf("Uploaded %llu Bytes to: %s\n",
+                     (unsigned long long)file_size, path);
+          }
+          file_fd = -1;
+        }
+
+        if (memcmp(buffer + after, "--", 2) == 0)
+          state = FORM_END;
+        else if (memcmp(buffer + after, "\r\n", 2) == 0)
+          state = FORM_HEADERS;
+        else
+          error = EPROTO;
+        consumed = after + 2;
+      }
+    }
+
+    memmove(buffer, buffer + consumed, len - consumed);
+    len -= consumed;
+    if (consumed || error || state == FORM_END)
+      continue;
+
+    // Nothing more can be done with what is buffered
+    ssize_t bytes_read =
+        body_read(body, buffer + len, UPLOAD_BUFFER_SIZE - len);
+    if (bytes_read == -1)
+      error = errno;
+    else if (bytes_read == 0)
+      error = EPROTO; // Body ended before the last boundary
+    else
+      len += bytes_read;
+  }
+
+  if (file_fd != -1)
+    upload_finish(dir_fd, file_fd, temp_name, name, 1);
+  close(dir_fd);
+  free(buffer);
+  fclose(files_out);
+
+  // Files written before an error are in place, and listed along with it
+  char *response_body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&response_body, &body_len);
+  if (!out) {
+    free(files);
+    return -1;
+  }
+  fputs("{", out);
+  if (error) {
+    fputs("\"error\":", out);
+    json_write_string(out, error == EPROTO ? "Malformed form data"
+                                           : strerror(error));
+    fputs(",", out);
+  }
+  fprintf(out, "\"files\":[%s]}", files);
+  fclose(out);
+  free(files);
+
+  snprintf(client->response_status, STATUS_SIZE, "%s",
+           error ? upload_status(error) : "201 Created");
+  int result = json_response(client, response_body, body_len);
+  free(response_body);
+  return result;
+}
+
+// Takes in a PUT or POST request, after checking the host's upload token
+// PUT writes the body to the file at the request path, POST writes the files
+// of a multipart form to the directory at the request path. Either way the
+// body is streamed to disk, in plain or chunked transfer encoding
+int handle_upload(struct client_info *client) {
+  const char *token = client->vhost->upload_token;
+  if (token[0] == '\0')
+    return json_error(client, "403 Forbidden", "Uploads are off");
+
+  char authorization[TOKEN_SIZE + 16];
+  if (!get_header(client, "Authorization", authorization,
+                  sizeof(authorization)) ||
+      strncasecmp(authorization, "Bearer ", 7) != 0 ||
+      !tokens_equal(authorization + 7, token)) {
+    char *unauthorized_response = "HTTP/1.1 401 Unauthorized\r\n"
+                                  "WWW-Authenticate: Bearer\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n\r\n";
+    write(client->client_fd, unauthorized_response,
+          strlen(unauthorized_response));
+    print_debug("Upload Token Rejected.\n");
+    return 0;
+  }
+
+  // Headers end at the blank line, anything read after it is the body
+  char *headers_end =
+      memmem(client->read_buffer, client->request_len, "\r\n\r\n", 4);
+  if (!headers_end)
+    return json_error(client, "431 Request Header Fields Too Large",
+                      "Request headers are too long");
+  struct request_body body = {
+      .client = client,
+      .buffered = headers_end + 4,
+      .buffered_len =
+          client->request_len - (headers_end + 4 - client->read_buffer)};
+
+  char value[64];
+  int64_t length = -1;
+  if (get_header(client, "Transfer-Encoding", value, sizeof(value))) {
+    if (strcasecmp(value, "chunked") != 0)
+      return json_error(client, "501 Not Implemented",
+                        "Only chunked transfer encoding is supported");
+    body.chunked = 1;
+  } else if (get_header(client, "Content-Length", value, sizeof(value))) {
+    char *value_end;
+    errno = 0;
+    length = strtoll(value, &value_end, 10);
+    if (value_end == value || *value_end || length < 0 || errno == ERANGE)
+      return json_error(client, "400 Bad Request", "Invalid Content-Length");
+    body.left = length;
+  } else
+    return json_error(client, "411 Length Required",
+                      "Content-Length or chunked encoding is required");
+
+  // Clients get SEND_TIMEOUT seconds to send every piece of the body, the
+  // same as they get to accept every piece of a response, and BODY_TIMEOUT
+  // seconds for all of it
+  body.deadline = BODY_TIMEOUT ? monotonic_ns() + (uint64_t)BODY_TIMEOUT *
+                                                      1000000000ULL
+                               : UINT64_MAX;
+
+  if (strcmp(client->request_method, "PUT") == 0)
+    return upload_file(client, &body, length);
+  return upload_form(client, &body);
+}
+
+// Maps the state shared by the watcher and the event streams, has to be
+// called before forking
+int watch_init(void) {
+  void *region = mmap(NULL, sizeof(struct watch_hub), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return -1;
+  watch_hub = region;
+  for (unsigned int i = 0; i < WATCH_MAX_DIRS; ++i)
+    watch_hub->dirs[i].wd = -1;
+
+  pthread_mutexattr_t lock_attr;
+  pthread_mutexattr_init(&lock_attr);
+  pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
+  int result = pthread_mutex_init(&watch_hub->lock, &lock_attr);
+  pthread_mutexattr_destroy(&lock_attr);
+  if (result != 0) {
+    errno = result;
+    return -1;
+  }
+
+  if ((watch_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    return -1;
+
+  print_debug("Watch Hub Mapped.\n");
+  return 0;
+}
+
+// Locks the directories, a process that died holding the lock leaves nothing
+// half done that matters, only counters and paths
+int watch_lock(void) {
+  int result = pthread_mutex_lock(&watch_hub->lock);
+  if (result == EOWNERDEAD)
+    pthread_mutex_consistent(&watch_hub->lock);
+  else if (result != 0) {
+    errno = result;
+    return -1;
+  }
+  return 0;
+}
+
+// Wakes every stream sleeping in watch_sleep()
+void watch_wake(void) {
+  __atomic_add_fetch(&watch_hub->wakeups, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &watch_hub->wakeups, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Sleeps until watch_wake() is called after 'wakeups' was read as 'seen', or
+// for at most 'timeout_ns'
+void watch_sleep(uint32_t seen, uint64_t timeout_ns) {
+  struct timespec timeout = {.tv_sec = timeout_ns / 1000000000ULL,
+                             .tv_nsec = timeout_ns % 1000000000ULL};
+  syscall(SYS_futex, &watch_hub->wakeups, FUTEX_WAIT, seen, &timeout, NULL,
+          0);
+}
+
+// Tells the watcher to add or remove watches for the subscribed directories
+void watch_notify(void) {
+  uint64_t one = 1;
+  if (write(watch_notify_fd, &one, sizeof(one)) == -1)
+    print_debug("Notifying Watcher failed.\n");
+}
+
+// Adds a stream of the current process following the directory at 'path',
+// taking a free slot for the directory if nobody follows it yet. Returns the
+// stream & sets the slot of the directory and its 'generation', or returns -1
+// if every slot is taken
+int watch_subscribe(const char *path, int *dir, uint32_t *generation) {
+  if (watch_lock() == -1)
+    return -1;
+
+  int stream = 0;
+  while (stream < WATCH_MAX_STREAMS && watch_hub->streams[stream].pid != 0)
+    stream++;
+
+  int found = -1, free_dir = -1;
+  for (int i = 0; i < WATCH_MAX_DIRS && found == -1; ++i) {
+    struct watch_dir *watched = &watch_hub->dirs[i];
+    if (watched->subscribers == 0 && watched->wd == -1) {
+      if (free_dir == -1)
+        free_dir = i;
+    } else if (strcmp(watched->path, path) == 0)
+      found = i;
+  }
+
+  // Events of the directory that had the slot before are told apart by the
+  // generation
+  if (found == -1 && (found = free_dir) != -1 && stream < WATCH_MAX_STREAMS) {
+    snprintf(watch_hub->dirs[found].path, PATH_SIZE, "%s", path);
+    watch_hub->dirs[found].generation++;
+  }
+  if (found == -1 || stream == WATCH_MAX_STREAMS)
+    stream = -1;
+  else {
+    watch_hub->dirs[found].subscribers++;
+    *dir = found;
+    *generation = watch_hub->dirs[found].generation;
+    watch_hub->streams[stream].dir = found;
+    watch_hub->streams[stream].dead = 0;
+    __atomic_store_n(&watch_hub->streams[stream].pid, getpid(),
+                     __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&watch_hub->lock);
+
+  if (stream != -1)
+    watch_notify();
+  return stream;
+}
+
+// Drops 'stream' from the subscribers of its directory, the watch goes once
+// the last one is gone. Has to be called with the lock held
+void watch_drop_stream(int stream) {
+  struct watch_stream *dropped = &watch_hub->streams[stream];
+  watch_hub->dirs[dropped->dir].subscribers--;
+  dropped->dead = 0;
+  __atomic_store_n(&dropped->pid, 0, __ATOMIC_RELEASE);
+}
+
+// Removes a stream added by watch_subscribe()
+void watch_unsubscribe(int stream) {
+  if (watch_lock() == -1)
+    return;
+  if (watch_hub->streams[stream].pid == getpid())
+    watch_drop_stream(stream);
+  pthread_mutex_unlock(&watch_hub->lock);
+  watch_notify();
+}
+
+// Drops the streams of connections that died without unsubscribing, then
+// adds watches for newly subscribed directories, and removes the ones nobody
+// follows anymore. Run by the watcher only
+void watch_update(int inotify_fd) {
+  if (watch_lock() == -1)
+    return;
+  for (unsigned int i = 0; i < WATCH_MAX_STREAMS; ++i)
+    if (watch_hub->streams[i].pid != 0 &&
+        __atomic_load_n(&watch_hub->streams[i].dead, __ATOMIC_ACQUIRE))
+      watch_drop_stream(i);
+  for (unsigned int i = 0; i < WATCH_MAX_DIRS; ++i) {
+    struct watch_dir *watched = &watch_hub->dirs[i];
+    int wd = watched->wd;
+    if (watched->subscribers && wd == -1) {
+      if ((wd = inotify_add_watch(inotify_fd, watched->path, WATCH_EVENTS)) ==
+          -1) {
+        wd = -2;
+        if (DEBUG == 1)
+          printf("Watching %s failed: %s\n", watched->path, strerror(errno));
+      }
+    } else if (!watched->subscribers && wd >= 0) {
+      inotify_rm_watch(inotify_fd, wd);
+      wd = -1;
+    } else if (!watched->subscribers && wd == -2)
+      wd = -1;
+    __atomic_store_n(&watched->wd, wd, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&watch_hub->lock);
+  watch_wake();
+}
+
+// Writes an event to the ring, for the directory in slot 'dir'. Run by the
+// watcher only, streams are woken up once a batch of events is written
+void watch_publish(uint32_t dir, uint8_t type, uint8_t is_dir,
+                   const char *name) {
+  uint64_t seq = watch_hub->published;
+  struct watch_event *event = &watch_hub->ring[seq % WATCH_RING_SIZE];
+
+  // Streams check the sequence before & after copying an event, so they
+  // notice if it changed in between
+  __atomic_store_n(&event->seq, UINT64_MAX, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  event->dir = dir;
+  event->generation = dir == WATCH_ALL ? 0 : watch_hub->dirs[dir].generation;
+  event->type = type;
+  event->is_dir = is_dir;
+  snprintf(event->name, sizeof(event->name), "%s", name);
+  __atomic_store_n(&event->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&watch_hub->published, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copies event 'seq' out of the ring, returns -1 if the watcher already wrote
+// over it
+int watch_read(uint64_t seq, struct watch_event *event) {
+  struct watch_event *ring_event = &watch_hub->ring[seq % WATCH_RING_SIZE];
+  if (__atomic_load_n(&ring_event->seq, __ATOMIC_ACQUIRE) != seq)
+    return -1;
+  memcpy(event, ring_event, sizeof(*event));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&ring_event->seq, __ATOMIC_RELAXED) != seq)
+    return -1;
+  event->name[NAME_MAX] = '\0';
+  return 0;
+}
+
+// Reads the pending inotify events, publishing them for the directories they
+// happened in
+void watch_events(int inotify_fd) {
+  char buffer[INDEX_EVENT_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *next = buffer; next < buffer + len;) {
+      struct inotify_event *event = (struct inotify_event *)next;
+      next += sizeof(struct inotify_event) + event->len;
+
+      // Events were lost, every stream has to start over
+      if (event->mask & IN_Q_OVERFLOW) {
+        watch_publish(WATCH_ALL, WATCH_RESET, 0, "");
+        continue;
+      }
+
+      uint32_t dir = 0;
+      while (dir < WATCH_MAX_DIRS && watch_hub->dirs[dir].wd != event->wd)
+        dir++;
+      if (dir == WATCH_MAX_DIRS)
+        continue; // Watch was removed, its last events are left
+
+      uint8_t is_dir = (event->mask & IN_ISDIR) != 0;
+      if (event->mask & IN_IGNORED) {
+        // Directory is gone, streams following it end after the reset
+        watch_publish(dir, WATCH_RESET, 0, "");
+        if (watch_lock() == 0) {
+          __atomic_store_n(&watch_hub->dirs[dir].wd, -2, __ATOMIC_RELEASE);
+          pthread_mutex_unlock(&watch_hub->lock);
+        }
+      } else if (event->mask & IN_MOVE_SELF)
+        // Path now leads elsewhere, or nowhere. Removing the watch ends up
+        // in IN_IGNORED as well
+        inotify_rm_watch(inotify_fd, event->wd);
+      else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        watch_publish(dir, WATCH_ADD, is_dir, event->name);
+      else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        watch_publish(dir, WATCH_REMOVE, is_dir, event->name);
+      else if (event->mask & IN_CLOSE_WRITE)
+        watch_publish(dir, WATCH_MODIFY, is_dir, event->name);
+    }
+  }
+
+  watch_wake();
+}
+
+// Watches every directory followed by an event stream, in a process of its
+// own with a single inotify instance, so a directory is watched once however
+// many clients follow it. Exits on SIGTERM
+void run_watcher(void) {
+  // Stopped by the server with a SIGTERM, which still runs shutdown_handler()
+  signal(SIGINT, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+  for (unsigned int i = 0; i < listeners_len; ++i)
+    close(listeners[i].fd);
+
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1)
+    err_n_die("Starting Watcher");
+
+  struct pollfd watch_polls[2] = {{.fd = watch_notify_fd, .events = POLLIN},
+                                  {.fd = inotify_fd, .events = POLLIN}};
+  watch_update(inotify_fd);
+
+  while (running) {
+    fflush(stdout);
+    if (poll(watch_polls, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      err_n_die("Polling Watch Events");
+    }
+    if (watch_polls[0].revents & POLLIN) {
+      uint64_t notifications;
+      if (read(watch_notify_fd, &notifications, sizeof(notifications)) > 0)
+        watch_update(inotify_fd);
+    }
+    if (watch_polls[1].revents & POLLIN)
+      watch_events(inotify_fd);
+  }
+
+  print_debug("Watcher Stopped.\n");
+  exit(0);
+}
+
+// Tells the event streams to end, as the server is shutting down. Clients
+// reconnect on their own, to the new binary in case of an upgrade
+void watch_close(void) {
+  __atomic_store_n(&watch_hub->closing, 1, __ATOMIC_RELEASE);
+  watch_wake();
+}
+
+// Streams changes to the requested directory as Server-Sent Events, until the
+// client goes away or the server shuts down
+// Events are 'add', 'remove' & 'modify' with the name as data, and 'reset'
+// if some were missed, after which the client has to list the directory again
+int stream_events(struct client_info *client) {
+  uint32_t generation;
+  int dir;
+  int stream = watch_subscribe(client->request_path, &dir, &generation);
+  if (stream == -1)
+    return json_error(client, "503 Service Unavailable",
+                      "Too many directories or streams are being followed");
+  struct watch_dir *watched = &watch_hub->dirs[dir];
+  uint64_t cursor = __atomic_load_n(&watch_hub->published, __ATOMIC_ACQUIRE);
+
+  // Waiting for the watch, so the stream only starts once nothing is missed
+  uint64_t deadline =
+      monotonic_ns() + (uint64_t)EVENTS_KEEPALIVE * 1000000000ULL;
+  int wd;
+  for (;;) {
+    uint32_t seen = __atomic_load_n(&watch_hub->wakeups, __ATOMIC_ACQUIRE);
+    uint64_t now = monotonic_ns();
+    if ((wd = __atomic_load_n(&watched->wd, __ATOMIC_ACQUIRE)) != -1 ||
+        now >= deadline || watch_hub->closing)
+      break;
+    watch_sleep(seen, deadline - now);
+  }
+  if (wd < 0) {
+    watch_unsubscribe(stream);
+    return json_error(client, "503 Service Unavailable",
+                      "Directory cannot be watched");
+  }
+
+  const char *header = "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/event-stream\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "Connection: close\r\n"
+                       "Access-Control-Allow-Origin: *\r\n"
+                       "\r\n"
+                       "event: ready\ndata: {}\n\n";
+  struct iovec header_iov = {(void *)header, strlen(header)};
+  int result = send_response(client, &header_iov, 1);
+  uint64_t keepalive_at =
+      monotonic_ns() + (uint64_t)EVENTS_KEEPALIVE * 1000000000ULL;
+
+  while (result == 0 &&
+         !__atomic_load_n(&watch_hub->closing, __ATOMIC_ACQUIRE)) {
+    uint32_t seen = __atomic_load_n(&watch_hub->wakeups, __ATOMIC_ACQUIRE);
+    uint64_t published =
+        __atomic_load_n(&watch_hub->published, __ATOMIC_ACQUIRE);
+
+    char *batch = NULL;
+    size_t batch_len = 0;
+    FILE *out = open_memstream(&batch, &batch_len);
+    if (!out) {
+      result = -1;
+      break;
+    }
+
+    // Events of other directories are skipped, and a stream lapped by the
+    // watcher starts over from the latest one
+    while (cursor < published) {
+      struct watch_event event;
+      if (published - cursor > WATCH_RING_SIZE ||
+          watch_read(cursor, &event) == -1) {
+        fputs("event: reset\ndata: {}\n\n", out);
+        cursor = published;
+        break;
+      }
+      cursor++;
+      if (event.dir != WATCH_ALL &&
+          (event.dir != (uint32_t)dir || event.generation != generation))
+        continue;
+      if (event.type == WATCH_RESET) {
+        fputs("event: reset\ndata: {}\n\n", out);
+        continue;
+      }
+      fprintf(out, "event: %s\ndata: {\"name\":",
+              WATCH_EVENT_NAMES[event.type]);
+      json_write_string(out, event.name);
+      fprintf(out, ",\"dir\":%s}\n\n", event.is_dir ? "true" : "false");
+    }
+
+    // Comments keep proxies from timing out an idle stream. Clients send
+    // nothing after the request, so a read that finds the end of the stream
+    // means the client went away
+    uint64_t now = monotonic_ns();
+    if (ftell(out) == 0 && now >= keepalive_at) {
+      char peek;
+      if (recv(client->client_fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        fclose(out);
+        free(batch);
+        break;
+      }
+      fputs(": keepalive\n\n", out);
+    }
+    fclose(out);
+
+    if (batch_len > 0) {
+      struct iovec batch_iov = {batch, batch_len};
+      result = send_response(client, &batch_iov, 1);
+      keepalive_at = now + (uint64_t)EVENTS_KEEPALIVE * 1000000000ULL;
+    }
+    free(batch);
+
+    // Watch is gone along with the directory, the stream ends once the reset
+    // published before that is sent
+    int gone = __atomic_load_n(&watched->wd, __ATOMIC_ACQUIRE) < 0;
+    published = __atomic_load_n(&watch_hub->published, __ATOMIC_ACQUIRE);
+    if (gone && cursor == published)
+      break;
+    if (result == 0 && cursor == published)
+      watch_sleep(seen, keepalive_at > now ? keepalive_at - now : 0);
+  }
+
+  int saved_errno = errno;
+  watch_unsubscribe(stream);
+  errno = saved_errno;
+
+  print_debug("Event Stream Ended.\n");
+  // Clients leaving is how every stream ends
+  if (result == -1 &&
+      (errno == EPIPE || errno == ECONNRESET || errno == ETIMEDOUT))
+    return 0;
+  return result;
+}
+
+// Takes in path, checks if it points to a directory or file, call the
+// respective functions to fill the response and sets size of the response
+// buffer Pointer to reponse pointer is required to change the response in the
+// main function
+int generate_response(struct client_info *client) {
+
+  // Uploads may name a file that does not exist yet
+  if (strcmp(client->request_method, "GET") != 0)
+    return handle_upload(client);
+
+  // Metadata of the dir/file
+  struct stat request_path_stat;
+
+  if (stat(client->request_path, &request_path_stat) == -1)
+    return -1;
+  else if (S_ISREG(request_path_stat.st_mode)) { // File
+    if (cache_lookup(client, &request_path_stat) == 1)
+      return 0;
+    if (read_file(client, NULL) == -1)
+      return -1;
+    cache_insert(client, &request_path_stat);
+  } else if (S_ISDIR(request_path_stat.st_mode)) { // Directory
+    // '?events' follows changes to the directory, as long as the client
+    // stays connected
+    char events_value[8];
+    if (get_query_param(client, "events", events_value, sizeof(events_value)))
+      return stream_events(client);
+    // '?archive=tar' downloads the whole directory, sent right here
+    char archive_format[8];
+    if (get_query_param(client, "archive", archive_format,
+                        sizeof(archive_format)) &&
+        strcmp(archive_format, "tar") == 0)
+      return stream_archive(client);
+    // '?search=' looks for names under the directory, in the index
+    char search_query[QUERY_SIZE];
+    if (get_query_param(client, "search", search_query,
+                        sizeof(search_query)))
+      return search_index(client, search_query);
+    if (read_directory(client) == -1)
+      return -1;
+  } else {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Reloads the configuration on SIGHUP, without touching the listening sockets
+// Resolves the '-r' directory again, so a symlinked root that got switched to
+// a new release is picked up by the following connections, then reads the
+// config file again. Keeps the old configuration if anything fails
+void reload_config(void) {
+  char new_root[PATH_SIZE];
+  if (root_arg && !realpath(root_arg, new_root)) {
+    printf("Reloading Root Directory failed, keeping: %s\n", root_dir);
+    return;
+  }
+
+  char old_root[PATH_SIZE];
+  strncpy(old_root, root_dir, PATH_SIZE);
+  if (root_arg)
+    strncpy(root_dir, new_root, PATH_SIZE);
+
+  if (load_config(0) == -1) {
+    strncpy(root_dir, old_root, PATH_SIZE);
+    puts("Reloading Configuration failed, keeping the old one.\n");
+    return;
+  }
+
+  printf("Configuration Reloaded.\nDefault Root Directory set to: %s\n\n",
+         default_vhost->root);
+
+  // Hosts may have new roots, the new indexer reads back the unchanged ones
+  // The old one may take a while to save its indexes, so it is not waited
+  // for here, the accept loop starts the new one once it exits
+  if (indexer_pid)
+    kill(indexer_pid, SIGTERM);
+  indexer_restart = 1;
+}
+
+// Picks up listening sockets passed in by systemd socket activation, or by
+// the old binary in case of a binary upgrade, both use the same environment
+// variables: LISTEN_PID (who the sockets are meant for) & LISTEN_FDS (number
+// of sockets, starting from fd 3)
+// Returns 1 if 'listeners' were set to passed in sockets, 0 if none were
+int get_inherited_sockets(void) {
+  const char *listen_pid = getenv("LISTEN_PID");
+  const char *listen_fds = getenv("LISTEN_FDS");
+
+  if (!listen_pid || !listen_fds || atoi(listen_pid) != getpid() ||
+      atoi(listen_fds) < 1)
+    return 0;
+
+  listeners_len = atoi(listen_fds);
+  if (listeners_len > MAX_LISTENERS)
+    listeners_len = MAX_LISTENERS;
+
+  for (unsigned int i = 0; i < listeners_len; ++i) {
+    listeners[i].fd = 3 + i;
+    listeners[i].address_len = sizeof(listeners[i].address);
+    if (getsockname(listeners[i].fd, (struct sockaddr *)&listeners[i].address,
+                    &listeners[i].address_len) == -1)
+      err_n_die("Using Inherited Socket");
+  }
+
+  // Not passing them on to any other process
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  print_debug("Using Inherited Listening Socket(s).\n");
+  return 1;
+}
+
+// Creates, binds and listens on a socket for every listener
+// Without any 'listen' lines in the config, listens on PORT, on localhost or
+// on all IPv4 interfaces with '-a'
+void open_listeners(void) {
+  if (listeners_len == 0) {
+    struct sockaddr_in *default_address =
+        (struct sockaddr_in *)&listeners[0].address;
+    memset(&listeners[0].address, 0, sizeof(listeners[0].address));
+    default_address->sin_family = AF_INET;
+    default_address->sin_port = htons(PORT);
+    default_address->sin_addr.s_addr = htonl(client_addr_t);
+    listeners[0].address_len = sizeof(struct sockaddr_in);
+    listeners_len = 1;
+
+    if (client_addr_t == INADDR_ANY)
+      puts("Server Accepting Incoming Connections from all IPs.\n");
+    else
+      puts("Server Accepting Incoming Connections from Localhost Only.\n");
+  }
+
+  for (unsigned int i = 0; i < listeners_len; ++i) {
+    struct listener *listener = &listeners[i];
+    int family = listener->address.ss_family;
+
+    // This returns a socket file descriptor as an int, which is like a two
+    // way door. This is through which all communication takes place.
+    if ((listener->fd = socket(family, SOCK_STREAM, 0)) == -1)
+      err_n_die("Creating Socket");
+    print_debug("Socket Created.\n");
+
+    // Restarting the server should not have to wait for old connections
+    // to time out before binding the same port
+    int on = 1;
+    if (setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ==
+        -1)
+      err_n_die("Setting Socket Options");
+
+    // An IPv6 socket would also take the IPv4 connections of its port, so
+    // 0.0.0.0 & [::] could not be listened on together
+    if (family == AF_INET6 && setsockopt(listener->fd, IPPROTO_IPV6,
+                                         IPV6_V6ONLY, &on, sizeof(on)) == -1)
+      err_n_die("Setting Socket Options");
+
+    // Now the socket has to be binded to an IP & a port, the address should
+    // be of any one of the interfaces on this machine. After binding all
+    // request to this socket will be routed to that particular IP/port.
+    // 0.0.0.0 (INADDR_ANY) targets all IPv4 interfaces, :: all IPv6 ones
+    if (bind(listener->fd, (struct sockaddr *)&listener->address,
+             listener->address_len) == -1)
+      err_n_die("Binding");
+    print_debug("Socket Binded to the port.\n");
+
+    // Now we can start listening with the socket on the ip and port assigned
+    if (listen(listener->fd, BACKLOG) == -1)
+      err_n_die("Listening");
+  }
+}
+
+// Closes all the listening sockets
+int close_listeners(void) {
+  for (unsigned int i = 0; i < listeners_len; ++i)
+    if (close(listeners[i].fd) == -1)
+      return -1;
+  return 0;
+}
+
+// Starts the binary at 'exe_path' (the new one, if the file was replaced) with
+// the same arguments, passing it the listening sockets. The old binary keeps
+// serving until the new one is ready, the new one then sends a SIGTERM to the
+// old one, which drains its connections and exits
+int upgrade_binary(void) {
+  if (upgrade_pid) {
+    puts("Binary Upgrade already in progress.\n");
+    return 0;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+    return -1;
+
+  if (pid == 0) {
+    // Own process group, so a Ctrl+C meant for the old binary does not reach
+    // the new one
+    setpgid(0, 0);
+    sigprocmask(SIG_UNBLOCK, &control_signals, NULL);
+
+    // Listening sockets have to start from fd 3 for get_inherited_sockets()
+    // Moving them out of the way first, so none of them gets overwritten
+    int moved_fds[MAX_LISTENERS];
+    for (unsigned int i = 0; i < listeners_len; ++i)
+      if ((moved_fds[i] = fcntl(listeners[i].fd, F_DUPFD, 3 + listeners_len)) ==
+          -1)
+        _exit(EXIT_FAILURE);
+    for (unsigned int i = 0; i < listeners_len; ++i) {
+      if (dup2(moved_fds[i], 3 + i) == -1)
+        _exit(EXIT_FAILURE);
+      close(moved_fds[i]);
+    }
+
+    char pid_str[16];
+    snprintf(pid_str, sizeof(pid_str), "%d", getpid());
+    setenv("LISTEN_PID", pid_str, 1);
+    snprintf(pid_str, sizeof(pid_str), "%u", listeners_len);
+    setenv("LISTEN_FDS", pid_str, 1);
+    // Telling the new binary who to shut down once it is ready
+    snprintf(pid_str, sizeof(pid_str), "%d", getppid());
+    setenv("SERVER_C_UPGRADE", pid_str, 1);
+
+    execv(exe_path, saved_argv);
+    _exit(EXIT_FAILURE);
+  }
+
+  upgrade_pid = pid;
+  printf("Started New Binary with PID: %d\n\n", pid);
+  return 0;
+}
+
+// Waits for the in-flight connections to finish after the server stopped
+// accepting new ones, for at most DRAIN_TIMEOUT seconds. Connections left
+// after that are sent a SIGTERM
+void drain_connections(void) {
+  uint64_t deadline = monotonic_ns() + (uint64_t)DRAIN_TIMEOUT * 1000000000ULL;
+
+  if (active_children > 0)
+    printf("Waiting for %d Connection(s) to Finish...\n", active_children);
+
+  while (active_children > 0 && monotonic_ns() < deadline) {
+    // SIGCHLD cuts the sleep short
+    struct timespec nap = {.tv_sec = 0, .tv_nsec = 100000000};
+    nanosleep(&nap, NULL);
+  }
+
+  if (active_children > 0) {
+    printf("Terminating %d Connection(s).\n", active_children);
+
+    // SIGCHLD is held back, so none of the PIDs is reaped, and possibly
+    // reused, while the list is walked
+    sigset_t sigchld_set;
+    sigemptyset(&sigchld_set);
+    sigaddset(&sigchld_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+    for (int i = 0; i < active_children; ++i)
+      kill(connection_pids[i], SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  // Resolving now, /proc/self/exe points to a deleted file once the binary is
+  // replaced, and the new one has to be started from the same path
+  if (readlink("/proc/self/exe", exe_path, PATH_SIZE - 1) == -1)
+    err_n_die("Finding Binary Path");
+  saved_argv = argv;
+  parse_args(argc,
+             argv); // PORT, root_dir & DEBUG will be set, if passed by user
+
+  // Listening sockets may be passed in by systemd or by the old binary, in
+  // which case they are already bound and listening
+  int inherited = get_inherited_sockets();
+
+  // 'listen' lines of the config are skipped if sockets were passed in
+  if (load_config(!inherited) == -1)
+    exit(EXIT_FAILURE);
+
+  if (!inherited)
+    open_listeners();
+
+  // Listeners are polled together in the accept loop, so accepting on one of
+  // them must never block, another process may take the connection first
+  struct pollfd listen_polls[MAX_LISTENERS];
+  for (unsigned int i = 0; i < listeners_len; ++i) {
+    int flags = fcntl(listeners[i].fd, F_GETFL);
+    if (flags == -1 ||
+        fcntl(listeners[i].fd, F_SETFL, flags | O_NONBLOCK) == -1)
+      err_n_die("Setting Listener Non-Blocking");
+    listen_polls[i].fd = listeners[i].fd;
+    listen_polls[i].events = POLLIN;
+
+    char listen_ip[INET6_ADDRSTRLEN] = {0}, listen_port[8] = {0};
+    getnameinfo((struct sockaddr *)&listeners[i].address,
+                listeners[i].address_len, listen_ip, sizeof(listen_ip),
+                listen_port, sizeof(listen_port),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+    if (listeners[i].address.ss_family == AF_INET6)
+      printf("Server Listening at: [%s]:%s\n", listen_ip, listen_port);
+    else
+      printf("Server Listening at: %s:%s\n", listen_ip, listen_port);
+  }
+  // Listener to check first, rotated so every listener gets its turn
+  unsigned int next_listener = 0;
 
   // Child processes will be creating next.
   // When a child exits, it is a zomibe process until its exit status is read
@@ -698,6 +5050,37 @@ int main(int argc, char *argv[]) {
   if (sigaction(SIGCHLD, &sa_reap, NULL) == -1)
     err_n_die("Reaping Child Processes");
 
+  // The global send clock has to be shared by all the children, so it is
+  // mapped before forking any of them. Mapped even without a global limit,
+  // as reloading the config may set one
+  global_send_ns = mmap(NULL, sizeof(*global_send_ns), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (global_send_ns == MAP_FAILED)
+    err_n_die("Mapping Global Send Clock");
+  *global_send_ns = 0;
+  print_debug("Global Send Clock Mapped.\n");
+
+  // Index files found valid are remembered for every child as well
+  index_checked = mmap(NULL, (INDEX_CHECKED_LEN + 1) * sizeof(uint64_t),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+                       0);
+  if (index_checked == MAP_FAILED)
+    err_n_die("Mapping Checked Indexes");
+
+  // Cache is shared by all the children as well
+  if (cache_init() == -1)
+    err_n_die("Mapping Cache");
+
+  // And so is everything the event streams need from the watcher
+  if (watch_init() == -1)
+    err_n_die("Mapping Watch Hub");
+
+  sigemptyset(&control_signals);
+  sigaddset(&control_signals, SIGINT);
+  sigaddset(&control_signals, SIGTERM);
+  sigaddset(&control_signals, SIGHUP);
+  sigaddset(&control_signals, SIGUSR2);
+
   // Handling shutdown
   struct sigaction sa_shutdown;
   sa_shutdown.sa_handler = shutdown_handler;
@@ -711,19 +5094,111 @@ int main(int argc, char *argv[]) {
       sigaction(SIGTERM, &sa_shutdown, NULL) == -1)
     err_n_die("Shutting Down");
 
+  // Writing to a client that closed the connection would kill the child with
+  // SIGPIPE, the write fails with EPIPE instead, and the child ends cleanly
+  signal(SIGPIPE, SIG_IGN);
+
+  // Handling reload & binary upgrade
+  // No SA_RESTART, so accept() is interrupted to act on them right away
+  struct sigaction sa_reload;
+  sa_reload.sa_handler = reload_handler;
+  sigemptyset(&sa_reload.sa_mask);
+  sa_reload.sa_flags = 0;
+
+  if (sigaction(SIGHUP, &sa_reload, NULL) == -1 ||
+      sigaction(SIGUSR2, &sa_reload, NULL) == -1)
+    err_n_die("Handling Reload Signals");
+
+  // Indexing runs in a process of its own, so it never holds up a request
+  start_indexer();
+
+  // Directories followed by event streams are watched by one process too
+  start_helper(run_watcher, &watcher_pid, "Watcher");
+
+  // If started by an upgrade, the new binary is ready now, and the old one
+  // can stop accepting and drain its connections
+  const char *old_binary = getenv("SERVER_C_UPGRADE");
+  if (old_binary) {
+    // Making sure the old binary is still the parent, and not some process
+    // that took over its PID
+    if (atoi(old_binary) == getppid() && kill(getppid(), SIGTERM) == -1)
+      err_n_die("Stopping Old Binary");
+    unsetenv("SERVER_C_UPGRADE");
+    print_debug("Old Binary Told to Shut Down.\n");
+  }
+
+  // SIGCHLD is blocked while forking, so the handler cannot run in the middle
+  // of the child being added to 'connection_pids'
+  sigset_t sigchld_set;
+  sigemptyset(&sigchld_set);
+  sigaddset(&sigchld_set, SIGCHLD);
+
+  // Control signals are only let in while waiting for connections, by
+  // ppoll(), so the flags they set are always seen right after
+  sigset_t wait_mask;
+  sigprocmask(SIG_BLOCK, &control_signals, &wait_mask);
+  sigdelset(&wait_mask, SIGINT);
+  sigdelset(&wait_mask, SIGTERM);
+  sigdelset(&wait_mask, SIGHUP);
+  sigdelset(&wait_mask, SIGUSR2);
+
   // Loop to accept incoming connections
   while (running == 1) {
-    // Accepting connections, requires the server_fd and an empty 'struct
+    if (reload) {
+      reload = 0;
+      reload_config();
+    }
+    if (indexer_restart && !indexer_pid) {
+      indexer_restart = 0;
+      start_indexer();
+    }
+    if (upgrade) {
+      upgrade = 0;
+      if (upgrade_binary() == -1)
+        printf("Binary Upgrade failed: %s\n\n", strerror(errno));
+    }
+
+    // Waiting for a connection on any of the listeners
+    // Signals interrupt the wait, and are acted on at the top of the loop
+    // Exit of an old indexer is not a control signal, it is checked for every
+    // 100ms until it happens
+    struct timespec restart_check = {.tv_sec = 0, .tv_nsec = 100000000};
+    if (ppoll(listen_polls, listeners_len,
+              indexer_restart ? &restart_check : NULL, &wait_mask) == -1) {
+      if (errno == EINTR)
+        continue; // Loop condition shuts the server down
+      else
+        err_n_die("Polling Listeners");
+    }
+
+    // Taking the first ready listener, starting after the last one used
+    int listen_fd = -1;
+    for (unsigned int i = 0; i < listeners_len && listen_fd == -1; ++i) {
+      unsigned int index = (next_listener + i) % listeners_len;
+      if (listen_polls[index].revents & POLLIN) {
+        listen_fd = listen_polls[index].fd;
+        next_listener = index + 1;
+      }
+    }
+    if (listen_fd == -1)
+      continue;
+
+    // Accepting connections, requires the listening fd and an empty 'struct
     // sockaddr' and its length. On connection, fills it with the address info
     // of the client After accepting, all communication with the said client
-    // is done on the new client_fd and server_fd still remains open listening
+    // is done on the new client_fd and listen_fd still remains open listening
     // for new conenctions.
     struct client_info new_client;
+    new_client.address_len = sizeof(new_client.client_address);
     new_client.response = NULL;
     new_client.response_len = 0;
+    new_client.body_fd = -1;
+    new_client.body_len = 0;
+    new_client.vhost = default_vhost;
+    new_client.next_send_ns = 0;
 
     if ((new_client.client_fd =
-             accept(server_fd, (struct sockaddr *)&new_client.client_address,
+             accept(listen_fd, (struct sockaddr *)&new_client.client_address,
                     &new_client.address_len)) == -1) {
       // Checking how the accept method failed
       // If errno == EINTR, it means the process was interrupted and the loop
@@ -732,13 +5207,20 @@ int main(int argc, char *argv[]) {
       // Have to do this for every error handling inside the while loop
       if (errno == EINTR && !running)
         break; // Breaking loop shuts the server down.
+      else if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == ECONNABORTED)
+        continue; // Connection was taken by another process, or is gone
       else
         err_n_die("Accepting");
     }
 
     pid_t pid;
 
+    // Anything still buffered would otherwise be printed again by the child
+    fflush(stdout);
+    sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
     if ((pid = fork()) == -1) {
+      sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
       if (errno == EINTR && !running)
         break;
       else
@@ -749,42 +5231,52 @@ int main(int argc, char *argv[]) {
     if (pid == 0) { // Inside Child process
       print_debug("Inside Child Process.\n");
 
-      if (close(server_fd) == -1) // Child should not be listening on server
+      // In-flight connections are not cut off by Ctrl+C or reloads, the
+      // parent waits for them and sends a SIGTERM if they take too long
+      signal(SIGINT, SIG_IGN);
+      signal(SIGHUP, SIG_IGN);
+      signal(SIGUSR2, SIG_IGN);
+      signal(SIGTERM, SIG_DFL);
+      sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+      sigprocmask(SIG_UNBLOCK, &control_signals, NULL);
+
+      if (close_listeners() == -1) // Child should not be listening on server
         err_n_die("Closing Server File Descriptor");
 
       print_debug("Closed Parent Server File Descriptor.\n");
 
+      // Writes to a client that stops reading give up after SEND_TIMEOUT,
+      // instead of blocking forever
+      struct timeval send_timeout = {.tv_sec = SEND_TIMEOUT};
+      if (setsockopt(new_client.client_fd, SOL_SOCKET, SO_SNDTIMEO,
+                     &send_timeout, sizeof(send_timeout)) == -1)
+        err_n_die("Setting Send Timeout");
+
       // Reading and responding
       // Now we can read the request from the client and send any response.
-      int bytes_read =
-          read(new_client.client_fd, new_client.read_buffer, READ_BUFFER_SIZE);
-
-      if (bytes_read == -1) {
+      if (read_request(&new_client) == -1) {
         if (errno == EINTR && !running)
           break;
-        else
+        else if (errno == ETIMEDOUT) {
+          char *timeout_response = "HTTP/1.1 408 Request Timeout\r\n"
+                                   "Connection: close\r\n\r\n";
+          write(new_client.client_fd, timeout_response,
+                strlen(timeout_response));
+          print_debug("Request Header Timed Out.\nExiting...\n");
+          exit(0);
+        } else if (errno == ECONNRESET) {
+          print_debug("Client Closed Connection Before Sending a "
+                      "Request.\nExiting...\n");
+          exit(0);
+        } else
           err_n_die("Reading");
       }
-      (new_client.read_buffer)[bytes_read] = '\0';
       print_debug("Incoming Request Read.\n");
 
       // Clearing any previous status codes
       memset(new_client.response_status, 0, STATUS_SIZE);
       (new_client.response_status)[0] = '\0';
 
-      // Setting Root Dir
-      if (strlen(root_dir) == 0) {
-        // If -r flag was not used, then the root_dir
-        // is not set yet and will have len of 0
-        if (set_root_dir() == -1) {
-          if (errno == EINTR && !running)
-            break;
-          else
-            err_n_die("Setting Root Directory");
-        }
-        print_debug("-r Option not used.\nRoot Directory set to default.\n");
-      }
-
       // Parse Request
       if (parse_request(&new_client) == -1 && errno != ENOENT) {
         if (errno == EINTR && !running)
@@ -804,11 +5296,19 @@ int main(int argc, char *argv[]) {
       print_debug("Response Generated.\n");
 
       // Writing Response
-      if (write(new_client.client_fd, new_client.response,
-                new_client.response_len) == -1) {
+      struct iovec response_iov = {new_client.response,
+                                   new_client.response_len};
+      if (send_response(&new_client, &response_iov, 1) == -1 ||
+          (new_client.body_fd != -1 &&
+           send_file_body(&new_client, new_client.body_fd,
+                          new_client.body_len) == -1)) {
         if (errno == EINTR && !running)
           break;
-        else
+        else if (errno == ETIMEDOUT || errno == EPIPE ||
+                 errno == ECONNRESET) {
+          print_debug("Client Stopped Receiving the Response.\nExiting...\n");
+          exit(0);
+        } else
           err_n_die("Writing Response");
       }
       print_debug("Response Written to the Client File Descriptor.\n");
@@ -821,12 +5321,25 @@ int main(int argc, char *argv[]) {
       }
       print_debug("Connection Closed.\n");
 
-      free(new_client.response);
+      if (new_client.response != cache_hit_buffer)
+        free(new_client.response);
       print_debug("Response Freed.\nExiting...\n");
       exit(0);
     } else if (pid > 0) {
       print_debug("Inside Parent Process.\n");
 
+      if (active_children == connection_pids_size) {
+        int new_size = connection_pids_size ? connection_pids_size * 2 : 64;
+        pid_t *grown =
+            realloc(connection_pids, new_size * sizeof(*connection_pids));
+        if (!grown)
+          err_n_die("Tracking Connection");
+        connection_pids = grown;
+        connection_pids_size = new_size;
+      }
+      connection_pids[active_children++] = pid;
+      sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+
       if (close(new_client.client_fd) == -1) {
         // Parent does not need client's fd anymore
         if (errno == EINTR && !running)
@@ -839,12 +5352,18 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  sigprocmask(SIG_UNBLOCK, &control_signals, NULL);
   printf("\nShutting Down...\n");
 
-  if (close(server_fd) == -1)
+  if (close_listeners() == -1)
     err_n_die("Closing Server File Descriptor");
 
   print_debug("Closed Server File Descriptor.\n");
 
+  watch_close();
+  drain_connections();
+  stop_indexer();
+  stop_helper(&watcher_pid);
+
   return 0;
 }
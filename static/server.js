@@ -1,13 +1,19 @@
 const files_list = document.querySelector("ul"), // Gets the first ul element
   file_preview = document.getElementById("file-preview"),
-  response_image = document.getElementById("response-image");
+  response_image = document.getElementById("response-image"),
+  search_input = document.getElementById("search");
 
 // This is the 'li' element which would be selected
 let selected_file = null,
   abort_controller = null, // Global abort_controller, needs to be defined for every request
   response_content_type = null, // Content-Type header of the current response, used to decide whether the re-render the whole 'file-preview' eleemnt with .innerHTML or just use .textContent
   current_url = window.location.href,
-  current_path = new URL(current_url).pathname;
+  current_path = new URL(current_url).pathname,
+  listing = null, // Entries of the directory, put back when the search is cleared
+  search_timer = null, // Waits for the user to stop typing before searching
+  search_query = "",
+  search_page = 0, // Last page of results shown
+  search_pages = 0;
 
 // Just so further requests do not contain double /
 // Won't cause any errors if it does but looks weird
@@ -202,10 +208,157 @@ async function make_request() {
   }
 };
 
+// Makes an 'li' for an entry of the list, a name or a path relative to the current directory
+function list_entry(path) {
+  const entry = document.createElement("li");
+  entry.textContent = path;
+  entry.onclick = () =>
+    visit_path(entry.textContent);
+  return entry;
+}
+
+// Searches the server's index for names under the current directory containing the query
+// Page 1 replaces the list with the results, later pages are added to the end of it
+async function search(query, page) {
+  search_query = query;
+  if (query == "") {
+    files_list.replaceChildren(...listing);
+    search_page = search_pages = 0;
+    select_file(files_list.firstElementChild);
+    return;
+  }
+
+  const search_url = new URL(current_url);
+  search_url.search = "";
+  search_url.searchParams.set("search", query);
+  search_url.searchParams.set("page", page);
+
+  const response = await fetch(search_url);
+  const results = await response.json();
+  // Results of a query that has been typed over since
+  if (query != search_query)
+    return;
+
+  if (!response.ok) {
+    files_list.replaceChildren();
+    text_preview(results.error);
+    return;
+  }
+
+  search_page = results.page;
+  search_pages = results.pages;
+
+  const entries = results.results.map(list_entry);
+  if (page == 1) {
+    files_list.replaceChildren(...entries);
+    files_list.scrollTop = 0;
+    if (entries.length)
+      select_file(files_list.firstElementChild);
+    else
+      text_preview("Nothing Found");
+  }
+  else
+    files_list.append(...entries);
+}
+
+// Loads the next page of results, if any
+// 'search_page' is moved on right away, so the same page is not asked for twice while scrolling
+function search_more() {
+  if (search_query != "" && search_page < search_pages)
+    search(search_query, ++search_page);
+}
+
+// Adds an entry the server said was created in the current directory
+// Added to the end like a listing would, which is in no particular order
+function add_entry(change) {
+  const name = change.name + (change.dir ? "/" : "");
+  if (listing.some((entry) => entry.textContent == name))
+    return;
+
+  const entry = list_entry(name);
+  listing.push(entry);
+  // Search results stay as they are, the entry shows up once the search is cleared
+  if (search_query == "") {
+    files_list.append(entry);
+    if (selected_file == null)
+      select_file(entry);
+  }
+}
+
+// Removes an entry the server said was deleted from the current directory
+function remove_entry(change) {
+  const name = change.name + (change.dir ? "/" : "");
+  const index = listing.findIndex((entry) => entry.textContent == name);
+  if (index == -1)
+    return;
+
+  const entry = listing[index];
+  listing.splice(index, 1);
+  if (entry == selected_file) {
+    const neighbour = entry.nextElementSibling || entry.previousElementSibling;
+    if (neighbour)
+      select_file(neighbour);
+    else {
+      selected_file = null;
+      file_preview.replaceChildren();
+    }
+  }
+  entry.remove();
+}
+
+// Lists the current directory again, when the server says some changes were missed
+async function reload_listing() {
+  const response = await fetch(current_url);
+  if (!response.ok)
+    return;
+
+  const page = new DOMParser().parseFromString(await response.text(), "text/html");
+  const selected_name = selected_file ? selected_file.textContent : null;
+  listing = Array.from(page.querySelector("ul").children, (file) => list_entry(file.textContent));
+  if (search_query != "")
+    return;
+
+  files_list.replaceChildren(...listing);
+  selected_file = null;
+  select_file(listing.find((entry) => entry.textContent == selected_name) || files_list.firstElementChild);
+}
+
+// Follows changes to the current directory as Server-Sent Events, applying them to the list as they come
+// instead of fetching the whole directory again
+function follow_changes() {
+  if (!window.EventSource)
+    return;
+
+  const events_url = new URL(current_url);
+  events_url.search = "";
+  events_url.searchParams.set("events", "");
+  const events = new EventSource(events_url);
+
+  // Anything that changed before the stream was following the directory was missed, either since the page
+  // was rendered or, as EventSource reconnects on its own, while it was reconnecting
+  events.addEventListener("ready", reload_listing);
+  events.addEventListener("reset", reload_listing);
+
+  events.addEventListener("add", (event) =>
+    add_entry(JSON.parse(event.data)));
+  events.addEventListener("remove", (event) =>
+    remove_entry(JSON.parse(event.data)));
+  // Previewed file was written to
+  events.addEventListener("modify", (event) => {
+    const change = JSON.parse(event.data);
+    if (selected_file && selected_file.textContent == change.name)
+      make_request();
+  });
+}
+
 function select_file(to_select) {
   if (to_select == null)
     return;
 
+  // Reaching the end of the results brings in the next page
+  if (to_select == files_list.lastElementChild)
+    search_more();
+
   if (selected_file)
     selected_file.classList.remove("highlight");
   to_select.classList.add("highlight");
@@ -217,6 +370,19 @@ function select_file(to_select) {
 // Hanldes motions and keypresses to change the highlighted file
 function handle_motion() {
   document.onkeyup = (event) => {
+    // Keys typed into the search box are only for the search box
+    if (event.target == search_input) {
+      if (event.key == "Escape") {
+        search_input.value = "";
+        search("", 1);
+      }
+      if (event.key == "Escape" || event.key == "Enter")
+        search_input.blur();
+      return;
+    }
+
+    if (event.key == "/")
+      search_input.focus();
     if (event.key == "j" || event.key == "Down" || event.key == "ArrowDown")
       select_file(selected_file.nextElementSibling);
     if (event.key == "k" || event.key == "Up" || event.key == "ArrowUp")
@@ -239,9 +405,21 @@ document.addEventListener("DOMContentLoaded", () => {
     file.onclick = () =>
       visit_path(file.textContent);
   }
+  listing = Array.from(files_list.children);
+
+  search_input.oninput = () => {
+    clearTimeout(search_timer);
+    search_timer = setTimeout(() => search(search_input.value.trim(), 1), 200);
+  };
+
+  files_list.onscroll = () => {
+    if (files_list.scrollTop + files_list.clientHeight >= files_list.scrollHeight - 50)
+      search_more();
+  };
 
   // Highlighting the first file
   select_file(files_list.firstElementChild);
 
   handle_motion();
+  follow_changes();
 });